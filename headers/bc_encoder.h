@@ -0,0 +1,24 @@
+#ifndef BC_ENCODER_H
+#define BC_ENCODER_H
+
+#include <cstddef>
+
+/* =======================================================================
+	Block compression (S3TC) encoder
+	Compresses RGBA images to BC1 (DXT1, 8 bytes per 4x4 block, opaque)
+	or BC3 (DXT5, 16 bytes per block, with alpha) so that frame images 
+	take 1/8 or 1/4 of the memory and upload bandwidth of RGBA8. Colour
+	endpoints are fitted along the principal axis of each block. 
+	Runs on the image loader's worker threads: no GL calls.
+======================================================================= */ 
+
+// bytes of one level of a w x h image, blockBytes = 8 (BC1) or 16 (BC3)
+size_t bcLevelBytes(int w, int h, int blockBytes);
+
+// rgba: w*h pixels, tightly packed; out: bcLevelBytes(w,h,..) bytes. Edges of images 
+// which are not a multiple of 4 are filled by replicating the last row/column.
+void compressBC1(const unsigned char * rgba, int w, int h, unsigned char * out);
+void compressBC3(const unsigned char * rgba, int w, int h, unsigned char * out);
+
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "../utils/simple_timer.h"
+
+#include "../glm/glm.hpp"
+
+using namespace std;
+
+/* =======================================================================
+	Camera
+	Owns the view and projection matrices, their product and its inverse
+	(recomputed only when a matrix changes, not per hit test), and the
+	viewport with the window size it was set for, so that window pixels
+	can be mapped to the world without querying GLUT.
+	The canvas is navigated by showing a rectangle of the view plane
+	(xmin..xmax, ymin..ymax) through an orthographic projection; there
+	are no bounds, only limits on the zoom. Panning moves the rectangle
+	with the cursor, zoomAt() scales it about a window pixel, which stays
+	over the same world point. Animated zooms approach their target with
+	the time constant smoothing, advanced once per drawn frame by
+	animate().
+======================================================================= */
+class Camera{
+	public:
+	glm::mat4 view, projection;		//!< change through setView()/setProjection(), which update the products
+	glm::mat4 viewProjection;		//!< projection*view
+	glm::mat4 inverseViewProjection;
+	int viewport[4];				//!< x, y, width, height in window pixels, y from the bottom (as glViewport)
+	int windowWidth, windowHeight;
+
+	float xmin, xmax, ymin, ymax;	//!< rectangle of the view plane shown in the viewport
+	float znear, zfar;
+	float minWidth, maxWidth;		//!< zoom limits, as width of the shown rectangle
+	float smoothing;				//!< time constant of animated zooms in seconds
+
+	private:
+	float target[4];				// xmin, xmax, ymin, ymax being approached by animate()
+	bool b_animating;
+	SimpleTimer animTimer;
+
+	public:
+	Camera();
+	void setView(const glm::mat4 &v);
+	void setProjection(const glm::mat4 &p);		// any projection, e.g. a tile of the view; showRect() restores the canvas one
+	void setViewport(int x, int y, int w, int h, int winWidth, int winHeight);
+
+	glm::vec2 screenToWorld(float x, float y);	// window pixel (origin top left, as in GLUT callbacks) to the world, in the plane z = 0
+
+	void showRect(float x0, float x1, float y0, float y1);	// show this rectangle of the view plane, immediately
+	void pan(float dx, float dy);							// move the canvas by (dx, dy) window pixels
+	void zoomAt(float x, float y, float factor, bool animated = true);	// zoom in (factor > 1) or out about a window pixel
+	bool animate();		// advance an animated zoom, once per drawn frame; true while the target is not reached
+
+	private:
+	void updateProjection();
+	void updateProducts();
+};
+
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef COLOR_CONVERT_H
+#define COLOR_CONVERT_H
+
+/* =======================================================================
+	YCbCr to RGBA conversion
+	Converts the interleaved YCbCr rows decoded by libjpeg (JFIF, full 
+	range) into the 4 byte RGBA layout of the texture pool, alpha 255.
+	Uses AVX2 or SSE2 when the CPU has them (chosen once, at first use),
+	plain C++ otherwise. Results match libjpeg's own conversion to 
+	within 1.
+	Runs on the image loader's worker threads: no GL calls.
+======================================================================= */ 
+
+// n pixels: ycc holds 3*n bytes, rgba receives 4*n bytes
+void yccToRGBA(const unsigned char * ycc, int n, unsigned char * rgba);
+
+
+#endif
@@ -7,8 +7,19 @@
 //#include <cuda_gl_interop.h>
 #include <vector>
 #include <string>
+#include <map>
 
 #include "../utils/simple_timer.h"
+#include "texture_pool.h"
+#include "offscreen.h"
+#include "image_loader.h"
+#include "mip_cache.h"
+#include "residency.h"
+#include "virtual_texture.h"
+#include "spatial_index.h"
+#include "camera.h"
+#include "id_picker.h"
+#include "snap_guides.h"
 //#include "../utils/simple_initializer.h"
 //#include "../utils/simple_palettes.h"
 
@@ -33,6 +44,46 @@ class Palette{
 	vector <float> map_values(float * v, int nval, int stride = 1, float vmin = 1e20, float vmax = 1e20);
 };
 
+/* =======================================================================
+	Shader program cache
+	Programs are compiled once per (name, variant) and shared by all
+	shapes that use them. The variant is a space separated list of macros
+	which are #define'd right after the #version line of both shaders.
+======================================================================= */ 
+class ShaderProgram{
+	public:
+	string name;			//!< shader name: src/shaders/shader_{vertex,fragment}_<name>.glsl
+	string variant;			//!< macros defined for this variant ("" for the plain program)
+	GLuint program_id;
+	int refCount;			//!< number of shapes currently holding this program
+	
+	// binding table, resolved once at link time (-1 if unused by the program)
+	GLint loc_model, loc_psize, loc_tex;	// uniforms
+	GLuint camera_block;					// GL_INVALID_INDEX if the program does not use the Camera block
+	map <string, GLint> uniforms;			// all active default-block uniforms
+
+	public:
+	ShaderProgram(string _name, string _variant);
+	~ShaderProgram();
+	
+	GLint uniformLocation(const string& s);
+	
+	private:
+	void resolveBindings();
+};
+
+// attribute locations are bound before linking, so a VAO works with any program
+const GLuint ATTR_POS = 0;
+const GLuint ATTR_COL = 1;
+const GLuint ATTR_UV  = 2;
+
+ShaderProgram * acquireProgram(string name, string variant = "");	// returns cached program, compiles on first use
+void releaseProgram(ShaderProgram * prog);
+void deleteUnusedPrograms();	// frees programs no longer held by any shape
+
+
+enum BlendMode {BlendOpaque, BlendAlpha};
+
 /* =======================================================================
 	Shape class
 ======================================================================= */ 
@@ -45,31 +96,37 @@ class Shape{
 	int dim; 		//!< Number of components per vertex (2 for 2D, 3 for 3D)
 	int nElements;
 	
+	GLuint vao;		//!< vertex array object capturing the attribute setup of vbo/cbo/tbo and ebo
 	GLuint vbo, cbo, ebo, tbo;
 	GLuint tex;
+	int texWidth, texHeight;	//!< size of the immutable storage of tex, 0 if none yet
 	bool textured;
 	bool usingElements;
 
-	GLuint vertexShader_id;
-	GLuint fragmentShader_id;
+	ShaderProgram * program;	//!< shared program from the cache, acquired in createShaders(); NULL for shapes without vertices (Frames)
 	GLuint program_id;
 	
-	string vertexShaderFile;
-	string fragmentShaderFile;
+	string shaderName;
 	
 	glm::mat4 model;
 	
 	float pointSize;
 	
+	int layer;			//!< drawing order of transparent shapes (back to front), depth of Frames
+	int blendMode;		//!< BlendOpaque or BlendAlpha
+	
 	bool b_render;
+	bool b_pickable;	//!< drawn in the ID pass of GPU picking (see IdPicker); shapes on layers below 0 (backdrops) never are
+	bool b_export;		//!< drawn in exported pages; false for on-screen aids such as the selection box and snap guides
 	
 	public:
 //	Shape(){};
 	Shape(int nVert, int components_per_vertex, string _type, string shader_name= "", bool ren = true);
-	~Shape();
+	virtual ~Shape();
 
 	void setVertices(void* data);
 	void setElements(int * elements, int n);
+	void createBuffers();
 	void createShaders();
 	void createColorBuffer();
 	
@@ -82,14 +139,16 @@ class Shape{
 	
 	void setColors(float* colData);
 	void applyTexture(float* uvs, unsigned char* pixels, int width, int height);
+	void setTexture(unsigned char* pixels, int width, int height);	// upload pixels to tex, without touching UVs
 	
-	void setRenderVariable(string s, float  f);
-	void setRenderVariable(string s, glm::vec2 f);
-	void setRenderVariable(string s, glm::vec3 f);
-	void setRenderVariable(string s, glm::vec4 f);
-	void setShaderVariable(string s, glm::mat4 f);
-
-	void render();
+	void setRenderVariable(const string& s, float  f);
+	void setRenderVariable(const string& s, glm::vec2 f);
+	void setRenderVariable(const string& s, glm::vec3 f);
+	void setRenderVariable(const string& s, glm::vec4 f);
+	void setShaderVariable(const string& s, glm::mat4 f);
+
+	virtual void render();
+	void draw(ShaderProgram * prog);	// the draw call of render(), with prog in use
 	
 	void useProgram();
 	
@@ -114,9 +173,27 @@ class Shape2D : public Shape{
 class Frame : public Shape{
 	public:
 	float x0, y0, x1, y1;
-	int layer;
+	glm::vec4 uvRect;	//!< part of the image shown in the frame: u0, v0, du, dv
+	TextureSlot * slot;	//!< where the image lives in glRenderer->texturePool, tex is the slot's array texture
+	
+	string filename;	//!< source of the image, empty for frames made from raw pixels
+	int residency;		//!< Evicted (placeholder), Thumbnail or FullRes, see ResidencyManager
+	int residentLimit;	//!< size limit (largest dimension) the resident image was loaded at, 0 for the placeholder
+	bool b_loading;		//!< a load of the image is queued or in flight
+	bool b_loadFailed;
+	long long lastUsed;	//!< last frame number in which the frame was visible
+	VirtualTexture * vt;	//!< tiles of an image larger than the pool's maxSize, NULL otherwise
 	public:
 	Frame(float _x0, float _y0, float _x1, float _y1, unsigned char* image, int width, int height);
+	Frame(float _x0, float _y0, float _x1, float _y1, string _filename);	// loads the image in the background, see ImageLoader
+	~Frame();
+	void setImage(TextureSlot * s, bool hasAlpha);	// show the image in slot s; the caller still releases s
+	void replaceImage(unsigned char* image, int width, int height);	// reuses the frame's layer if the size class matches
+	void replaceImage(string _filename);	// keeps showing the current image until the new one is resident
+	void setUVRect(glm::vec4 r);			// crop, without touching the image
+	float screenArea();		// visible area in window pixels
+	int   requiredLimit();	// level of detail (image size limit, a power of 2) giving one texel per window pixel
+	void render();		// queues the frame in glRenderer->frameRenderer
 	void setLayer(int l);
 	void setExtent(float xmin, float xmax, float ymin, float ymax);
 	void setSize(float _x0, float _y0, float _x1, float _y1);
@@ -128,7 +205,100 @@ class Frame : public Shape{
 };
 
 
-enum UpdateMode {Step, Time};
+/* =======================================================================
+	FrameRenderer
+	Draws Frames as instances of one shared unit quad. Frames queue
+	themselves in render() (with the tiles of their VirtualTexture, if 
+	any), and flush() uploads their rectangles into an instance buffer and
+	draws all instances sharing a texture array (i.e. a page of the 
+	texture pool) with a single glDrawElementsInstanced call.
+======================================================================= */ 
+struct FrameInstance{
+	glm::vec4 rect;		// x0, y0, x1, y1 in world coordinates
+	glm::vec4 uvRect;	// u0, v0, du, dv
+	glm::vec2 zSlice;	// depth of the frame's layer, texture array layer
+};
+
+// per-instance attribute locations of the frame shader
+const GLuint ATTR_RECT   = 3;
+const GLuint ATTR_UVRECT = 4;
+const GLuint ATTR_ZSLICE = 5;
+
+class FrameRenderer{
+	public:
+	ShaderProgram * program;
+	GLuint vao;
+	GLuint quad_vbo, quad_ebo;	// shared unit quad
+	GLuint instance_vbo;
+	int capacity;				// number of instances the instance buffer can hold
+	
+	vector <FrameInstance> instances;	// queued instances
+	vector <GLuint> textures;			// texture array of each queued instance
+	
+	public:
+	void init();		// needs a GL context
+	void destroy();
+	void submit(Frame * f);
+	void submit(const FrameInstance &inst, GLuint tex);
+	void flush(ShaderProgram * prog = NULL, GLuint firstId = 0);	// prog replaces the frame program, e.g. by its PICK variant, which gets instance i's id as firstId+i
+	
+	private:
+	void setInstanceOffset(int first);
+};
+
+
+/* =======================================================================
+	RenderState
+	Shadow copy of the bound program/VAO/textures and blend flag, so 
+	that redundant binds are skipped, with counters of the state changes
+	and draw calls issued in the current frame.
+======================================================================= */ 
+class RenderState{
+	public:
+	GLuint program, vao, tex2D, texArray;
+	bool blend;
+	
+	int nDrawCalls;
+	int nProgramChanges, nVaoChanges, nTextureChanges, nBlendChanges;
+	
+	public:
+	void reset();		// forget the bound state and zero the counters, at the start of a frame
+	void useProgram(GLuint p);
+	void bindVertexArray(GLuint v);
+	void bindTexture(GLenum target, GLuint t);	// on unit 0
+	void setBlend(bool b);
+	void print();
+};
+
+
+/* =======================================================================
+	RenderQueue
+	Sorts the visible shapes before drawing. Opaque shapes are drawn 
+	first, sorted by program, texture and VAO to minimize state changes. 
+	Transparent shapes follow, back to front by layer, then by state.
+======================================================================= */ 
+class RenderQueue{
+	public:
+	struct Item{
+		unsigned long long key;
+		Shape * shape;
+	};
+	vector <Item> items;
+	RenderState stats;		// state changes of the last submitted frame
+
+	public:
+	void build(vector <Shape*> &shapes);
+	void submit();
+	
+	static unsigned long long sortKey(Shape * s);
+};
+
+
+enum UpdateMode {Step, Time, FreeRun};
+
+// Uniform buffer binding point of the per-frame camera block, shared by all programs:
+// layout(std140) uniform Camera { mat4 view; mat4 projection; mat4 viewProjection; };
+const GLuint CAMERA_UBO_BINDING = 0;
 
 class Renderer{
 	private:
@@ -138,9 +308,7 @@ class Renderer{
 
 	public:	
 	
-	glm::mat4 view, projection;
-	float camera_tx, camera_ty;
-	float camera_s, camera_rx, camera_ry;
+	Camera camera;		// view/projection, viewport, pan and zoom
 	
 	int up_axis;
 	
@@ -150,6 +318,13 @@ class Renderer{
 	int updateMode; 		// update mode: update after fixed time or fixed steps
 	int quality;			// quality of graphics
 	bool b_paused;
+	bool b_dirty;			// scene has changed since the last display()
+	bool b_headless;		// no window, rendering goes to the offscreen framebuffer
+	bool b_exporting;		// exportTiled() is rendering: shapes without b_export are left out
+	long long nSteps;		// producer steps to date
+	int stepsSinceDisplay;	// producer steps since the last display()
+	bool b_timerArmed;		// a timerEvent is pending; the timer only runs while the producer steps
+	string title;			// window title last set, see updateTitle()
 	//int b_anim_on;
 
 	// layers - by default only layer 0 is visible
@@ -172,11 +347,23 @@ class Renderer{
 	bool b_renderAxes;
 	bool b_renderColorMap;
 		
-	// frame counter
+	// frame counter (display rate) and step counter (producer rate)
 	SimpleCounter frameCounter;
+	SimpleCounter stepCounter;
 	
 	// GPU stuff
-	GLuint vao_id;
+	GLuint camera_ubo;	// view/projection shared by all programs, see CAMERA_UBO_BINDING
+	FrameRenderer frameRenderer;
+	TexturePool texturePool;	// texture arrays holding all frame images
+	ImageLoader imageLoader;	// background decoding of frame images
+	MipCache mipCache;			// decoded images on disk, for the image loader
+	ResidencyManager residency;	// GPU memory budget for frame images
+	RenderState state;			// currently bound GL state
+	RenderQueue renderQueue;
+	SpatialIndex frameIndex;	// world rectangles of all frames, for pick()
+	IdPicker idPicker;			// picking by rendering shape ids, if enabled
+	SnapGuides guides;			// snapping of dragged frames, with the guides shown
+	Framebuffer * offscreen;	// render target in headless mode, NULL otherwise
 
 	int swap;	// index of the most recently updated buffer	
 
@@ -186,9 +373,17 @@ class Renderer{
 	public:
 	// init
 	void init();
+	void createCameraBuffer();	// needs a GL context
+	void updateCameraBuffer();	// upload the camera's view/projection, once per frame
 
 	// fancy stuff
 	int getDisplayInterval();
+	void setUpdateMode(int mode, int t);	// t: interval in ms (Time) or steps per display (Step), ignored for FreeRun
+	void step();							// called by the producer after each step
+	void armTimer();						// schedule one timerEvent, unless one is pending
+	void updateTitle();						// set the window title if its text has changed
+	void markDirty();		// request a redraw
+	void renderOffscreen(unsigned char * rgba);
 
 	// add shapes to render list
 	int addShape(Shape* shp);
@@ -208,7 +403,7 @@ class Renderer{
 	void toggleGrid();
 	void toggleAxes();
 	
-	Shape * pick(int x, int y);
+	Shape * pick(int x, int y);		// topmost shape at the window pixel, NULL if none
 };
 
 // pointers to the particle system to display and renderer to render display
@@ -217,11 +412,18 @@ extern int generic_count;
 //extern ParticleSystem * glPsys;
 
 // util functions
-void loadShader(string filename, GLuint &shader_id, GLenum shader_type);
+void loadShader(string filename, GLuint &shader_id, GLenum shader_type, string defines = "");
 vector <float> calcExtent(float* data, int nVertices, int dim);
+void waitForWindowEvents(int timeout_ms, int wakeFd = -1);	// sleep until window input arrives or wakeFd becomes readable (no timeout if timeout_ms < 0)
 
 // openGL callbacks
 bool init_hyperGL(int *argc, char **argv);
+bool init_hyperGL_headless(int width, int height);	// EGL context without a window, see offscreen.cpp
+void cleanup_hyperGL_headless();			// release the EGL context, called by cleanup_hyperGL()
+void initGLState();
+void renderScene();
+void hyperGL_mainLoop();
+void hyperGL_processEvents(bool block, int timeout_ms = -1);
 void timerEvent(int value);
 void reshape(int w, int h);
 void keyPress(unsigned char key, int x, int y);
@@ -229,8 +431,10 @@ void specialKeyPress(int key, int x, int y);
 void mouseMove(int x, int y);
 void mouseHover(int x, int y);
 void mousePress(int button, int state, int x, int y);
+void mouseWheel(int wheel, int direction, int x, int y);
 void display();
 void cleanup();
+void cleanup_hyperGL();
 
 
 #endif
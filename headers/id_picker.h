@@ -0,0 +1,76 @@
+#ifndef ID_PICKER_H
+#define ID_PICKER_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <string>
+#include <map>
+
+#include "offscreen.h"
+
+using namespace std;
+
+class Shape;
+class ShaderProgram;
+
+/* =======================================================================
+	IdPicker
+	Picking by rendering: the pickable shapes are drawn with the PICK
+	variant of their programs, which writes a shape id instead of a
+	colour, into an R32UI framebuffer the size of the viewport. Only a
+	small square around the cursor is drawn (scissor) and read back, into
+	a pixel buffer guarded by a fence, so that the CPU never waits for
+	the GPU: the id is collected by poll() once the fence has signalled.
+	This hits what is actually drawn, i.e. the masked parts of frames
+	(alpha below 0.5) are skipped, and lines and points can be picked;
+	within radius pixels of the cursor the nearest hit wins.
+	A request made while a readback is in flight replaces any earlier
+	waiting one and is started when the readback has been collected.
+	Results are tagged with the frame number and expire when the scene
+	is drawn again; refresh() repeats the last request after every drawn
+	frame, so that the pixel under a resting cursor stays answered.
+======================================================================= */
+class IdPicker{
+	public:
+	bool b_enabled;			//!< Renderer::pick() uses the ID pass; otherwise only frames are picked, by the frameIndex
+	int radius;				//!< pixels around the cursor searched for the nearest shape
+
+	Framebuffer fbo;		//!< R32UI ids and depth, created at the size of the viewport
+	GLuint pbo;
+	GLsync fence;			//!< readback in flight, 0 if none
+
+	private:
+	vector <Shape*> ids;	// shape drawn with id i+1 in the pass in flight, 0 is the background
+	map <string, ShaderProgram*> pickPrograms;	// PICK variant of each program, by name|variant
+	int readX, readY, readW, readH;		// rectangle read back, in framebuffer pixels
+	int cursorX, cursorY;				// in framebuffer pixels
+	int requestX, requestY;				// window pixel of the pass in flight
+	long long requestFrame;				// frame number it was rendered in
+	bool b_waiting;						// request waiting for the readback in flight
+	int waitingX, waitingY;
+	bool b_tracking;					// pixel of the last request, for refresh()
+	int trackX, trackY;
+
+	bool b_result;
+	int resultX, resultY;
+	long long resultFrame;
+	Shape * picked;
+
+	public:
+	IdPicker();
+	void init();		// needs a GL context
+	void destroy();
+
+	void request(int x, int y);		// pick at the window pixel (origin top left)
+	void refresh();					// after drawing: request the last pixel again
+	void poll();					// collect a finished readback, without waiting, and start a waiting request
+	bool result(int x, int y, Shape * &s);	// the shape at this pixel (NULL for none), false if no readback for it has arrived or the scene has been redrawn since
+
+	private:
+	void renderIds(int x, int y);
+	void collect();
+	ShaderProgram * pickProgram(ShaderProgram * p);
+};
+
+
+#endif
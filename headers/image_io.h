@@ -0,0 +1,55 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <vector>
+#include <string>
+#include <cstdio>
+
+using namespace std;
+
+// Decode an image file into RGBA pixels (4 bytes per pixel, rows top to bottom).
+// The format is detected from the file contents: JPEG, PNG and binary PPM/PAM 
+// (as written by exportTiled) are supported. Safe to call from any thread.
+// With limit > 0 the image may come out smaller than stored, but with its 
+// larger dimension no smaller than limit: JPEGs are then decoded at 1/2, 1/4
+// or 1/8 scale in the DCT domain, which is several times faster.
+bool loadImage(string filename, vector <unsigned char> &pixels, int &width, int &height, int limit = 0);
+
+bool loadJPEG(string filename, vector <unsigned char> &pixels, int &width, int &height, int limit = 0);
+bool loadPNG(string filename, vector <unsigned char> &pixels, int &width, int &height);
+bool loadPNM(string filename, vector <unsigned char> &pixels, int &width, int &height);
+
+// image size from the file header, without decoding
+bool readImageSize(string filename, int &width, int &height);
+
+
+/* =======================================================================
+	ImageReader
+	Decodes an image one row at a time, for images too large to hold in
+	memory as a whole (see VirtualTexture). JPEG and PPM/PAM are streamed;
+	PNG is decoded up front.
+======================================================================= */ 
+struct JpegReader;
+
+class ImageReader{
+	public:
+	int width, height;
+	
+	private:
+	FILE * fp;
+	JpegReader * jpeg;		// JPEG decompressor, NULL for other formats
+	int channels;			// PPM/PAM: 3 or 4
+	vector <unsigned char> row;
+	vector <unsigned char> pixels;	// PNG: the whole image
+	int y;					// next row
+	
+	public:
+	ImageReader();
+	~ImageReader();
+	bool open(string filename);
+	bool readRow(unsigned char * rgba);	// next row (top to bottom) as RGBA, false on error or past the end
+	void close();
+};
+
+
+#endif
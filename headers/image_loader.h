@@ -0,0 +1,139 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "texture_pool.h"
+
+using namespace std;
+
+class Frame;
+class MipCache;
+
+/* =======================================================================
+	ImageLoader
+	Loads frame images in the background. Worker threads read and decode
+	the files and prepare the padded mip chain for the texture pool, 
+	optionally block compressed (or map it from the MipCache); the
+	GL thread only copies finished images into a pixel unpack buffer and
+	issues the texture uploads from it (pump()), a few per frame, so it 
+	never waits for disk or decoding. 
+	Until its image is resident, a frame shows a shared placeholder slot.
+	Images stream in two stages: a small thumbnail for every frame first,
+	then the level of detail the frame needs on screen (Frame::requiredLimit),
+	which replaces the thumbnail in the frame's own slot. These jobs are 
+	served largest on-screen area first.
+	Workers stop taking jobs while decoded images of more than
+	decodedLimit bytes wait for upload, so that RAM use stays bounded
+	however many images are requested at once.
+	Images larger than the pool's maxSize are cut into a tile store on 
+	first load; the frame then shows the store's overview and gets a 
+	VirtualTexture for the detail (needs the MipCache for the store).
+======================================================================= */ 
+enum LoadStage {ThumbStage, LodStage};
+
+class ImageJob{
+	public:
+	Frame * frame;		//!< NULL once the frame has been destroyed
+	string filename;
+	int stage;			//!< ThumbStage or LodStage
+	int limit;			//!< largest dimension of the stored image
+	float priority;		//!< on-screen area of the frame in pixels
+	bool compress;		//!< block compress the levels: ImageLoader::b_compress when requested, workers never read that
+	
+	// filled in by the worker
+	bool ok;
+	bool hasAlpha;
+	unsigned long long contentHash;	//!< hash of the source file, identifies duplicate photos
+	bool complete;			//!< the image fits the size limit unscaled, no larger level of detail exists
+	int width, height;		//!< size of the stored image (after fitting the size limit)
+	int W, H;				//!< size class
+	GLenum format;			//!< GL_RGBA8, or BC1/BC3 when compression is on
+	vector <unsigned char> levels;	//!< padded mip chain, level 0 first, when decoded
+	vector <size_t> offsets;		//!< start of each level in data
+	const unsigned char * data;		//!< the mip chain: levels, or a mapped MipCache entry
+	size_t dataSize;
+	void * map;						//!< mapped cache entry, unmapped with the job
+	size_t mapSize;
+	string tileStore;				//!< VirtualTexture tiles of an image larger than the pool's maxSize, "" otherwise
+	
+	public:
+	ImageJob(Frame * f, string _filename, int _stage, int _limit);
+	~ImageJob();
+};
+
+bool jobOrder(const ImageJob * a, const ImageJob * b);	// heap order of pending jobs: thumbnails first, then by priority
+
+
+class ImageLoader{
+	public:
+	TexturePool * pool;
+	TextureSlot * placeholder;	//!< grey texel shown by frames which are still loading
+	MipCache * cache;			//!< decoded mip chains on disk, NULL to always decode
+	
+	int nThreads;
+	int thumbSize;				//!< largest dimension of thumbnails
+	int tileSize;				//!< tile size of virtual textures, for images larger than the pool's maxSize
+	bool b_compress;			//!< store images block compressed (BC1, or BC3 with alpha), see enableCompression()
+	size_t uploadBudget;		//!< bytes uploaded per pump(), keeps frame times bounded
+	size_t decodedLimit;		//!< bytes of decoded images waiting for upload before the workers pause
+	
+	vector <ImageJob*> pending;	// waiting for a worker, heap ordered by jobOrder
+	vector <ImageJob*> running;	// being decoded
+	deque <ImageJob*> decoded;	// waiting for upload
+	size_t decodedBytes;		// their mip chains
+	
+	GLuint pbo[2];				// upload buffers, used alternately
+	int nextPbo;
+	
+	int wakePipe[2];			// a byte is written to wakePipe[1] when an image has been decoded
+	
+	private:
+	vector <thread> workers;
+	mutex mtx;
+	condition_variable cond;			// signals workers: new job or quit
+	condition_variable decodedCond;		// signals finish(): a job has been decoded
+	bool b_quit;
+	
+	struct FileHash{
+		long long size, mtime;
+		unsigned long long hash;
+	};
+	map <string, FileHash> fileHashes;	// by file name: each version of a file is read for its hash once
+	mutex hashMtx;
+
+	public:
+	ImageLoader();
+	void init(TexturePool * _pool, MipCache * _cache = NULL, int _nThreads = 0);	// needs a GL context; 0 threads = one per core, less the GL thread
+	void destroy();
+	
+	void request(Frame * f, string filename, int stage = ThumbStage, int limit = 0);	// f shows the thumbnail, then the needed level of detail, once resident
+	void cancel(Frame * f);						// drop outstanding work for f (called when f is destroyed)
+	
+	bool enableCompression(bool on);	// false if the driver lacks S3TC; affects images requested afterwards
+	
+	bool pump();			// GL thread: upload decoded images, true if any frame changed
+	void finish();			// GL thread: block until all requested images are resident
+	int  nOutstanding();	// images requested but not yet resident
+	int  wakeFd();			// readable when decoded images are waiting for pump()
+	const unsigned char * stageUpload(const unsigned char * data, size_t bytes);	// GL thread: copy into a bound pixel unpack buffer
+	
+	private:
+	void enqueue(ImageJob * job);	// mtx must be held
+	void updatePriorities();		// re-rank pending jobs by the frames' current on-screen area
+	void workerLoop();
+	void decode(ImageJob * job);
+	unsigned long long fileHash(const string &filename);	// content hash of the file, thread safe
+	void compressMipChain(ImageJob * job);
+	void upload(ImageJob * job);
+};
+
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef MIP_CACHE_H
+#define MIP_CACHE_H
+
+#include <string>
+#include <mutex>
+#include <cstddef>
+#include <sys/stat.h>
+
+#include "image_loader.h"
+
+using namespace std;
+
+/* =======================================================================
+	MipCache
+	Persistent cache of the padded RGBA mip chains made by the image 
+	loader's workers, so that images are decoded and downsampled once.
+	Each entry is one file named by a hash of the source path, its mtime
+	(in nanoseconds) and size, the size limit of the chain (thumbnail or full) and whether
+	it is block compressed. A hit 
+	is memory mapped and handed to the upload as is: no decode, no copy.
+	A smaller level of detail is also served from the tail levels of an
+	entry with a larger size limit, where these are padded to a size 
+	class of the pool (as a decode would be).
+	Entries are written to a temporary file and renamed into place, so 
+	concurrent workers and crashed runs never leave partial entries.
+	The cache, tile stores included, is kept below maxBytes: each hit 
+	sets the mtime of the entry, and once new files take the cache over
+	the limit, the entries used longest ago are deleted until it is 
+	down to 3/4 of it.
+======================================================================= */ 
+long long modificationTime(const struct stat &st);	// st_mtim in nanoseconds
+
+struct MipCacheHeader{
+	char magic[4];			// "MIPC"
+	int version;
+	long long srcSize;		// source file size and modification time
+	long long srcMtime;		// nanoseconds
+	int limit;				// size limit the chain was built for
+	int width, height;		// stored image
+	int W, H;				// size class
+	int nLevels;
+	unsigned int format;	// GL internal format of the levels
+	int hasAlpha, complete;
+	unsigned long long contentHash;	// of the source file, see ImageJob
+	int pathLength;			// the source path follows the header, then the levels
+};
+
+class MipCache{
+	public:
+	string dir;
+	bool b_enabled;
+	size_t maxBytes;		//!< on disk, entries and tile stores
+	
+	private:
+	mutex mtx;
+	size_t bytes;			// on disk, as of the last scan plus the files added since
+	
+	public:
+	MipCache();
+	bool init(string _dir = "");	// default: $XDG_CACHE_HOME/album_designer or ~/.cache/album_designer
+	
+	// thread safe, called by the loader's workers
+	bool lookup(ImageJob * job, int limit, const TexturePool * pool, bool compressed);	// map the entry for limit, or the levels of a larger one (up to the pool's maxSize) down to limit, into job; false on a miss
+	void store(ImageJob * job, int limit, bool compressed);		// write job's mip chain
+	string tileStorePath(const string &filename);			// where the VirtualTexture tiles of filename live, "" if disabled; marks the store used
+	void add(const string &file);		// count a new file in the cache, and trim the cache if it has grown beyond maxBytes
+	
+	private:
+	void trim(size_t target);		// delete the entries used longest ago until at most target bytes are left
+	size_t scan();
+	string entryPath(const string &path, long long size, long long mtime, int limit, bool compressed);
+	bool mapEntry(ImageJob * job, const string &path, struct stat &src, int limit, const TexturePool * pool, bool compressed, int entryLimit);
+};
+
+
+#endif
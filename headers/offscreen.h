@@ -0,0 +1,29 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <GL/glew.h>
+
+/* =======================================================================
+	Framebuffer
+	An offscreen render target: a framebuffer object with a colour and 
+	a depth renderbuffer. Used for headless rendering.
+======================================================================= */ 
+class Framebuffer{
+	public:
+	GLuint fbo;
+	GLuint color_rbo, depth_rbo;
+	int width, height;
+	GLenum colorFormat;		// internal format of the colour buffer
+	
+	public:
+	Framebuffer();
+	bool create(int w, int h, GLenum format = GL_RGBA8);	// false if the framebuffer is incomplete
+	void destroy();
+	void bind();			// bind for drawing and set the viewport to cover it
+	void unbind();			// back to the default framebuffer
+	void readPixels(unsigned char * rgba);	// RGBA8, top row first
+};
+
+
+#endif
+
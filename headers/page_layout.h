@@ -0,0 +1,84 @@
+#ifndef PAGE_LAYOUT_H
+#define PAGE_LAYOUT_H
+
+#include <vector>
+#include <atomic>
+
+#include "../glm/glm.hpp"
+
+using namespace std;
+
+class Frame;
+
+/* =======================================================================
+	PageLayout
+	Places an album of photos, in order, onto pages. Each page holds a
+	run of consecutive photos in one of three styles:
+	  - justified rows: rows of equal height across the page, photos
+	    uncropped, as many rows as fit best;
+	  - grid: equal cells, photos cropped to the cell;
+	  - collage: the page cut in two, across or along, and each part cut
+	    again, sized so that each part matches the photos it holds;
+	    photos are cropped where the fit is not exact.
+	A candidate is scored by its cropping loss (the part of each photo
+	cut away, weighted by its area on the page) and its whitespace (the
+	part of the page inside the margins not covered by photos). The best
+	layout of every run of up to maxPerPage photos from every position
+	is found in parallel on nThreads threads, then the album is split
+	into pages by dynamic programming over these scores plus pageCost
+	per page. Pages are placed left to right from origin.
+	apply() moves the frames into their cells, with their crops, in one
+	pass before the next frame is drawn.
+======================================================================= */
+class PageLayout{
+	public:
+	enum Style {JustifiedRows, Grid, Collage};
+
+	float pageWidth, pageHeight;	//!< world units
+	float margin;					//!< between the page edges and the photos
+	float spacing;					//!< between photos
+	float pageGap;					//!< between pages
+	glm::vec2 origin;				//!< lower left corner of the first page
+	int minPerPage, maxPerPage;		//!< photos per page; runs shorter than minPerPage score 1 worse
+	float cropWeight, spaceWeight;	//!< weights of cropping loss and whitespace in the score of a page
+	float pageCost;					//!< added per page: higher values put more photos on a page
+	int styles;						//!< styles tried, bit mask of 1 << Style
+	int nThreads;					//!< 0 = one per core
+
+	struct Cell{
+		int page;
+		int style;
+		glm::vec4 rect;		//!< x0, y0, x1, y1 in world units
+		glm::vec4 uvRect;	//!< crop of the photo to the cell, as Frame::uvRect
+	};
+	int nPages;						//!< of the last layout
+	float score;					//!< of the last layout: page scores, pageCost and penalties, as minimised
+
+	private:
+	struct PageCandidate{
+		float score;
+		int style;
+		vector <glm::vec4> rects;	// relative to the lower left corner inside the margins
+	};
+	const float * aspects;			// of the album being laid out
+	int nPhotos;
+	vector <PageCandidate> best;	// of the run of k photos from i, at i*maxPerPage + k-1
+
+	public:
+	PageLayout();
+	vector <Cell> layout(const vector <float> &aspects);	// one cell per photo, aspect = width/height
+	vector <Cell> layout(const vector <Frame*> &frames);	// by the aspects of the frames' images
+	static float aspectOf(Frame * f);	// of the image: stored, or from the file header while not loaded yet
+	static void apply(const vector <Frame*> &frames, const vector <Cell> &cells);
+
+	private:
+	void evaluate(int i, PageCandidate * out);	// best layout of each run from photo i
+	void worker(atomic <int> * next);
+	void consider(PageCandidate &c, int style, const float * a, const vector <glm::vec4> &rects);
+	void justifiedRows(const float * a, int n, PageCandidate &c);
+	void grid(const float * a, int n, PageCandidate &c);
+	void collage(const float * a, int n, PageCandidate &c);
+};
+
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+class Frame;
+
+/* =======================================================================
+	ResidencyManager
+	Keeps the texture pool within a GPU byte budget.
+	After every drawn frame, frames visible in the viewport are stamped
+	with the frame number; while the pool's pages exceed the budget, the
+	least recently visible frames are first downgraded to a thumbnail 
+	(copied on the GPU from their own lower mip levels into a free layer
+	of an existing page) and then evicted to the placeholder, and the 
+	pool is compacted so that the layers given up free their pages.
+	The resident tiles of all VirtualTextures are limited to maxTiles in
+	the same pass, least recently drawn first.
+	Frames that become visible again are re-requested from the 
+	ImageLoader. Frames made from raw pixels cannot be reloaded and are
+	not managed, but count against the budget.
+======================================================================= */ 
+enum Residency {Evicted, Thumbnail, FullRes};
+
+class ResidencyManager{
+	public:
+	size_t budget;				//!< bytes of texture pool pages (all mip levels) allowed on the GPU
+	int maxTiles;				//!< VirtualTexture tiles resident at once, over all frames
+	long long frameNumber;		//!< number of updates, i.e. drawn frames
+	vector <Frame*> frames;		//!< file backed frames
+	
+	int nResident, nDowngraded, nEvicted;	//!< frames at the detail they need / thumbnail / placeholder, as of the last update
+	int nDowngrades, nEvictions;			//!< totals since start
+	
+	public:
+	ResidencyManager();
+	void add(Frame * f);
+	void remove(Frame * f);
+	
+	void update();					// after drawing a frame on screen: mark visible frames, request missing images, enforce the budget
+	size_t usedBytes();				// GPU bytes of the texture pool
+	bool fits(size_t bytes);		// would an upload of this size stay within the budget?
+	int limitTiles(long long before);	// release the least recently drawn tiles beyond maxTiles, among those not drawn since frame number 'before'; returns the number released
+	void printStats();
+	
+	private:
+	size_t downgrade(Frame * f);	// full resolution -> thumbnail, returns the bytes of the layers given up, 0 if not possible
+	size_t evict(Frame * f);		// -> placeholder, returns the bytes of the layers given up
+};
+
+
+#endif
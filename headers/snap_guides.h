@@ -0,0 +1,82 @@
+#ifndef SNAP_GUIDES_H
+#define SNAP_GUIDES_H
+
+#include <vector>
+#include <map>
+
+#include "../glm/glm.hpp"
+
+using namespace std;
+
+class Frame;
+class Shape;
+
+/* =======================================================================
+	SnapGuides
+	Snapping of dragged frames to the edges and centres of the other
+	frames, to fixed guides (page edges, margins and centre), and to equal
+	spacing: centred between the neighbours on either side, or repeating
+	a neighbour's gap to its own neighbour.
+	The edges of all frames are kept in sorted lists per axis (low edges,
+	centres, high edges), which frames update in setSize/move/resize, so
+	a snap costs a few lookups of logarithmic time instead of a pass over
+	all frames. Neighbours for equal spacing are found by walking the
+	lists outward from the dragged frame, over at most maxScan frames
+	which do not overlap it across the axis.
+	The snap distance is tolerance window pixels; the guides of the last
+	snap are drawn as lines until clear() is called at the end of a drag.
+======================================================================= */
+class SnapGuides{
+	public:
+	bool b_enabled;
+	float tolerance;			//!< snap distance in window pixels
+	int maxScan;				//!< frames looked at in search of a neighbour for equal spacing
+	int maxLines;				//!< guide lines drawn at most
+	glm::vec4 page;				//!< x0, y0, x1, y1 of the page set by setPage(), if any
+	vector <float> pageGuides[2];	//!< fixed guides on x and y, sorted
+
+	struct Line{
+		glm::vec2 a, b;
+	};
+	vector <Line> active;		//!< guides of the last snap, in world coordinates
+
+	private:
+	typedef multimap <float, Frame*> EdgeList;
+	EdgeList edges[2][3];		// per axis: low edges, centres, high edges
+	struct Entry{
+		EdgeList::iterator it[2][3];
+	};
+	map <Frame*, Entry> entries;
+	Shape * lines;				// shows the active guides, created on first use
+	int linesCapacity;
+
+	struct Candidate{
+		float shift;			// to add to the dragged edges
+		float dist;				// |shift|, the tolerance while none is found
+		int type;				// alignment with an edge or page guide, or spacing
+		float pos;				// aligned coordinate
+		Line gaps[2];			// equal gaps, for spacing
+	};
+
+	public:
+	SnapGuides();
+	void insert(Frame * f);
+	void update(Frame * f);		// after the frame's rectangle changed, no-op for frames not in the lists
+	void remove(Frame * f);
+	void setPage(float x0, float y0, float x1, float y1, float margin);	// page edges, margins and centre become guides
+
+	glm::vec4 snapMove(Frame * f, glm::vec4 r);		// r (x0, y0, x1, y1): where f is being dragged to; returns it snapped and shows the guides
+	glm::vec4 snapResize(Frame * f, glm::vec4 r);	// the same for dragging the (x1, y1) corner
+	void clear();				// hide the guides
+
+	private:
+	static void consider(Candidate &best, float shift, int type, float pos);
+	void align(Frame * f, int axis, const float * m, int nm, Candidate &best);
+	void spacing(Frame * f, int axis, glm::vec4 r, float tol, Candidate &best);
+	Frame * neighbour(int axis, float v, bool below, float lo, float hi, Frame * skip1, Frame * skip2);
+	void addGuides(Frame * f, int axis, glm::vec4 r, const Candidate &c);
+	void show();
+};
+
+
+#endif
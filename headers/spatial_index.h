@@ -0,0 +1,56 @@
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include <vector>
+#include <map>
+
+using namespace std;
+
+class Frame;
+
+/* =======================================================================
+	SpatialIndex
+	Uniform grid over the world rectangles of all Frames, for hit testing
+	(Renderer::pick) without visiting every shape. Each frame is listed in
+	the cells its rectangle overlaps; frames overlapping more than
+	maxCells cells (e.g. a backdrop covering the canvas) are kept in a
+	separate list instead, which every query checks.
+	Frames add themselves on construction and keep their entry up to date
+	in setSize/move/resize/setLayer. Cell lists are only touched when the
+	range of cells covered changes; the rectangle itself is read from the
+	frame at query time.
+======================================================================= */
+class SpatialIndex{
+	public:
+	float cellSize;		//!< world units per grid cell
+	int maxCells;		//!< frames overlapping more cells are not put in the grid
+
+	private:
+	struct Entry{
+		int cx0, cy0, cx1, cy1;	// range of cells covered, empty (cx1 < cx0) for frames in the large list
+		long long order;		// insertion number, ties between frames of the same layer go to the last added
+	};
+	map <Frame*, Entry> entries;
+	map <long long, vector <Frame*> > cells;	// by cellKey()
+	vector <Frame*> large;
+	long long nextOrder;
+
+	public:
+	SpatialIndex();
+	void insert(Frame * f);
+	void update(Frame * f);		// after the frame's rectangle or layer changed, no-op for frames not in the index
+	void remove(Frame * f);
+	void setCellSize(float s);	// re-bins all frames
+	int  size();
+
+	Frame * topmost(float x, float y);	// visible, pickable frame with the highest layer >= 0 containing the world point, NULL if none
+
+	private:
+	long long cellKey(int cx, int cy);
+	void cellRange(Frame * f, Entry &e);
+	void link(Frame * f, const Entry &e);
+	void unlink(Frame * f, const Entry &e);
+};
+
+
+#endif
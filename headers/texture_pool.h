@@ -0,0 +1,122 @@
+#ifndef TEXTURE_POOL_H
+#define TEXTURE_POOL_H
+
+#include <GL/glew.h>
+#include <vector>
+#include <map>
+#include <cstddef>
+
+#include "../glm/glm.hpp"
+
+using namespace std;
+
+/* =======================================================================
+	Texture pool
+	Frame images are packed into GL_TEXTURE_2D_ARRAYs ("pages"). Each 
+	page holds layers of one size class (width and height are powers of
+	2 up to 256 and multiples of 256 above), and every image occupies the
+	corner of one layer. The first pages of a class have few layers,
+	later ones up to pageBytes. The pool hands out slots which tell
+	where an image lives: (page texture, layer, UV-rect).
+	Since all frames of a size class share one texture, they can be drawn 
+	without texture rebinds.
+	Slots are reference counted, so that several frames can show the 
+	same image (e.g. the loading placeholder). Slots holding an image of 
+	known content are registered by a hash of their source (see 
+	share()), and frames showing the same photo get the same slot back 
+	from findShared(), so that duplicates cost GPU memory once.
+	Pages are RGBA8 or block compressed (BC1/BC3), and pages of different
+	formats are never shared.
+	A page is deleted when its last layer is released. Layers freed in 
+	pages which still hold others are only given back by compact(), which
+	moves images out of the emptiest pages of a class into the free 
+	layers of the others (slots keep their identity, their tex and layer
+	change).
+======================================================================= */ 
+class TexturePage;
+
+class TextureSlot{
+	public:
+	TexturePage * page;
+	GLuint tex;			//!< the GL_TEXTURE_2D_ARRAY of the page
+	int layer;			//!< layer within the array
+	int width, height;	//!< size of the stored image in texels
+	glm::vec4 uvRect;	//!< image within the layer: u0, v0, du, dv
+	int refCount;		//!< number of users, the layer is freed when this drops to 0
+	unsigned long long hash;	//!< content hash of the source image, 0 if the slot is not shared
+};
+
+
+class TexturePage{
+	public:
+	GLuint tex;
+	int width, height;		// size class
+	int nLayers, nLevels;
+	GLenum format;			// GL_RGBA8 or a compressed internal format
+	vector <int> freeLayers;
+	vector <TextureSlot*> slots;	// user of each layer, NULL if free
+
+	public:
+	TexturePage(int w, int h, int layers, GLenum _format = GL_RGBA8);
+	~TexturePage();
+	size_t bytes();			// GPU footprint including mip levels
+	size_t layerBytes();	// footprint of one layer including mip levels
+};
+
+
+class TexturePool{
+	public:
+	vector <TexturePage*> pages;
+	map <unsigned long long, TextureSlot*> shared;	// slots holding a known image, by shareKey()
+	
+	int minSize;			// smallest size class (in either dimension)
+	int maxSize;			// largest size class, limited by GL_MAX_TEXTURE_SIZE
+	int maxLayers;			// GL_MAX_ARRAY_TEXTURE_LAYERS
+	size_t pageBytes;		// target size of a page, decides the number of layers of each size class
+
+	public:
+	void init();			// needs a GL context
+	void destroy();
+	
+	TextureSlot * acquire(unsigned char * pixels, int width, int height);	// shares the slot of identical pixels
+	TextureSlot * allocate(int W, int H, GLenum format = GL_RGBA8, bool grow = true);	// empty layer of size class W x H; NULL if !grow and no existing page has one
+	void retain(TextureSlot * slot);
+	void release(TextureSlot * slot);
+	void swapStorage(TextureSlot * a, TextureSlot * b);	// exchange the layers of two slots, e.g. to replace an image in place
+	void upload(TextureSlot * slot, unsigned char * pixels, int width, int height);
+	void uploadLevels(TextureSlot * slot, int width, int height, const unsigned char * data, const vector <size_t> &offsets);	// levels in the page's format; data may be an offset into the bound GL_PIXEL_UNPACK_BUFFER
+	
+	TextureSlot * findShared(unsigned long long hash, int width, int height, GLenum format = GL_RGBA8);	// retained slot holding that image at that size, NULL if none
+	void share(TextureSlot * slot, unsigned long long hash);	// register the image now in slot (uploads unregister it)
+	
+	void sizeClass(int width, int height, int &w, int &h, int &W, int &H, int limit = 0) const;	// stored size (w,h) and size class (W,H) of an image, no larger than limit if > 0; no GL calls
+	int classSize(int n) const;		// size class of an image dimension n <= maxSize
+	size_t newPageBytes(int W, int H, GLenum format);	// footprint of the page allocate() would add for class W x H
+	
+	size_t gpuBytes();		// total GPU footprint of all pages
+	size_t compact();		// free the pages whose images fit into the free layers of their class, returns the bytes freed
+	void printStats();
+	
+	private:
+	TexturePage * findPage(int w, int h, GLenum format, bool grow = true);
+	int newPageLayers(int w, int h, GLenum format);
+	void move(TextureSlot * slot, TexturePage * q);
+	unsigned long long shareKey(unsigned long long hash, int width, int height, GLenum format);
+	void unshare(TextureSlot * slot);
+};
+
+// image helpers (RGBA, 4 bytes per pixel, tightly packed rows)
+void downsampleImage(const unsigned char * src, int w, int h, unsigned char * dst);		// 2x2 box filter to max(w/2,1) x max(h/2,1)
+bool imageHasAlpha(const unsigned char * src, int w, int h);		// true if any pixel is not fully opaque
+void padImage(const unsigned char * src, int w, int h, unsigned char * dst, int W, int H);	// copy into W x H, replicating edge texels
+int  mipLevels(int W, int H);		// number of mip levels of a W x H texture
+size_t levelBytes(GLenum format, int w, int h);	// size of one w x h level in RGBA8 or BC1/BC3
+bool isCompressedFormat(GLenum format);
+unsigned long long hashBytes(const void * data, size_t n, unsigned long long seed = 14695981039346656037ULL);	// continue with the previous result as seed
+unsigned long long hashImage(const unsigned char * pixels, int w, int h);	// content hash for sharing slots, never 0
+// halve the image down to w x h, pad it to W x H and append all mip levels to levels (level l starts at offsets[l])
+void buildMipChain(const unsigned char * pixels, int width, int height, int w, int h, int W, int H, vector <unsigned char> &levels, vector <size_t> &offsets);
+
+
+#endif
+
@@ -0,0 +1,50 @@
+#ifndef TILED_EXPORT_H
+#define TILED_EXPORT_H
+
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+/* =======================================================================
+	TiledImageWriter
+	Writes an uncompressed image file one tile at a time. Rows have a 
+	fixed pitch, so each tile row is written by seeking straight to its 
+	place in the file and the full raster never has to be held in memory.
+	The format follows the extension: .ppm is RGB (P6), anything else is
+	RGBA PAM (P7).
+	Write errors (e.g. a full disk) are remembered and reported by
+	close(); discard() closes and deletes an incomplete file.
+======================================================================= */ 
+class TiledImageWriter{
+	public:
+	FILE * fp;
+	string filename;
+	int width, height;
+	int channels;		// 3 for ppm, 4 for pam
+	long long dataOffset;	// size of the header
+	bool b_error;		// a write or seek has failed since open()
+
+	public:
+	TiledImageWriter();
+	bool open(string _filename, int w, int h);
+	bool writeTile(int x, int y, int w, int h, const unsigned char * rgba, bool bottomUp = false);	// rgba: w*h pixels, tightly packed
+	bool close();		// false if anything failed to be written
+	void discard();
+};
+
+
+// Render the region (x0,y0)-(x1,y1) of the scene into a width x height image file, 
+// tile by tile. The region is given in world coordinates of the current view; for 
+// printing, width = region width in inches * dpi. The frames in the region are first 
+// loaded at the detail this resolution needs (up to the pool's maxSize). Each tile 
+// adjusts the projection, is rendered into an offscreen framebuffer and read back 
+// asynchronously through a pixel buffer, so memory use is bounded by a few tiles 
+// regardless of the image size.
+// Line widths and point sizes are in pixels and do not scale with the resolution.
+// On-screen aids, shapes without b_export such as the selection box, are left out.
+bool exportTiled(string filename, float x0, float y0, float x1, float y1, int width, int height, int tileSize = 2048);
+
+
+#endif
+
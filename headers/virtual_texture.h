@@ -0,0 +1,102 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <vector>
+#include <string>
+#include <map>
+
+#include "texture_pool.h"
+
+using namespace std;
+
+class Frame;
+
+/* =======================================================================
+	VirtualTexture
+	Detail for images larger than the texture pool's maxSize (panoramas,
+	scans of 100 MP and more), which no single texture can hold.
+	The image is cut once, by a worker of the ImageLoader, into a tile
+	store next to the MipCache entries: the image pyramid from full
+	resolution down to the first level that fits maxSize, each level
+	split into tileSize x tileSize RGBA tiles. That last level (the
+	overview) is what the frame shows as its ordinary pool image.
+	The source is streamed row by row (ImageReader), so neither the image
+	nor the pyramid is ever held in memory as a whole.
+	When the frame is drawn at more texels than the overview has, the
+	tiles of the matching pyramid level which are on screen are made
+	resident in the pool and drawn over the overview as extra instances.
+	The tile store is memory mapped: a newly needed tile is prefetched
+	(madvise) and uploaded in a later frame, a few per frame. In 
+	synchronous mode (b_synchronous, set while exporting) every tile on
+	screen is uploaded before it is drawn instead.
+	The ResidencyManager keeps at most its maxTiles tiles resident over
+	all frames, the least recently drawn go first, so the GPU memory is
+	bounded however large and however many the images are.
+======================================================================= */
+struct TileStoreHeader{
+	char magic[4];			// "VTEX"
+	int version;
+	long long srcSize;		// source file size and modification time
+	long long srcMtime;		// nanoseconds
+	int width, height;		// full resolution image
+	int tileSize;
+	int nLevels;			// tiled levels; level nLevels is the overview
+	int overviewWidth, overviewHeight;
+	int hasAlpha;
+};
+
+class VirtualTexture;
+
+struct TileUse{
+	long long lastUsed;		// frame number in which the tile was last on screen
+	VirtualTexture * vt;
+	long long key;
+};
+
+class VirtualTexture{
+	public:
+	string store;			//!< path of the tile store
+	int width, height;		//!< full resolution image
+	int tileSize;
+	int nLevels;			//!< tiled pyramid levels, level 0 is full resolution
+	vector <int> levelWidth, levelHeight;
+	vector <int> tilesX, tilesY;
+	vector <int> firstTile;	//!< index of the first tile of each level in the store
+
+	int maxUploads;			//!< tile uploads per drawn frame
+	int nPending;			//!< tiles on screen but not yet resident, as of the last render()
+	static bool b_synchronous;	//!< upload all tiles on screen in render(), for exports
+
+	private:
+	struct Tile{
+		TextureSlot * slot;		// NULL until uploaded
+		long long lastUsed;		// frame number in which the tile was last on screen
+	};
+	map <long long, Tile> tiles;	// by tileKey()
+
+	unsigned char * data;			// mapped tile store
+	size_t dataSize;
+
+	public:
+	VirtualTexture();
+	~VirtualTexture();
+	bool open(const string &_store);	// map the tile store of the frame's image, false if missing or invalid
+
+	void render(Frame * f);		// GL thread: queue the resident tiles on screen in glRenderer->frameRenderer, after the frame itself
+	void releaseTiles();		// make no tile resident (frame evicted or hidden)
+	size_t residentBytes();
+	void residentTiles(vector <TileUse> &out);	// append the resident tiles
+	void releaseTile(long long key);
+
+	// worker thread: build the tile store of filename unless a valid one exists, and return the overview
+	static bool prepare(const string &filename, const string &store, int tileSize, int maxSize, vector <unsigned char> &overview, int &width, int &height);
+
+	private:
+	long long tileKey(int level, int tx, int ty);
+	const unsigned char * tileData(int level, int tx, int ty);
+	TextureSlot * uploadTile(int level, int tx, int ty);
+	void dropUnused(long long frameNumber);
+};
+
+
+#endif
@@ -0,0 +1,139 @@
+#include "../headers/bc_encoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+
+size_t bcLevelBytes(int w, int h, int blockBytes){
+	return size_t((w+3)/4)*((h+3)/4)*blockBytes;
+}
+
+// 4x4 block with its top-left corner at (x,y), clamped to the image
+static void fetchBlock(const unsigned char * rgba, int w, int h, int x, int y, unsigned char block[64]){
+	for (int j=0; j<4; ++j){
+		const unsigned char * row = rgba + 4*size_t(w)*min(y+j, h-1);
+		for (int i=0; i<4; ++i) memcpy(block + 4*(4*j+i), row + 4*min(x+i, w-1), 4);
+	}
+}
+
+static unsigned short pack565(const float c[3]){
+	int r = int(c[0]*31.f/255.f + 0.5f), g = int(c[1]*63.f/255.f + 0.5f), b = int(c[2]*31.f/255.f + 0.5f);
+	r = max(0, min(r, 31)); g = max(0, min(g, 63)); b = max(0, min(b, 31));
+	return (r << 11) | (g << 5) | b;
+}
+
+static void unpack565(unsigned short c, int rgb[3]){
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// 8 byte colour block in 4-colour mode (colour0 > colour1), as used by BC1 and BC3
+static void encodeColorBlock(const unsigned char block[64], unsigned char * out){
+	// principal axis of the colours: mean and covariance, then power iteration
+	float mean[3] = {0,0,0};
+	for (int p=0; p<16; ++p) for (int c=0; c<3; ++c) mean[c] += block[4*p+c];
+	for (int c=0; c<3; ++c) mean[c] /= 16;
+	
+	float cov[6] = {0,0,0,0,0,0};	// xx xy xz yy yz zz
+	for (int p=0; p<16; ++p){
+		float d[3] = {block[4*p]-mean[0], block[4*p+1]-mean[1], block[4*p+2]-mean[2]};
+		cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1]; cov[2] += d[0]*d[2];
+		cov[3] += d[1]*d[1]; cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+	}
+	float axis[3] = {1,1,1};
+	for (int it=0; it<8; ++it){
+		float a[3] = {cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2],
+		              cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2],
+		              cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2]};
+		float n = max(fabs(a[0]), max(fabs(a[1]), fabs(a[2])));
+		if (n < 1e-6f) break;		// flat block, keep the current axis
+		for (int c=0; c<3; ++c) axis[c] = a[c]/n;
+	}
+	
+	// endpoints: extreme projections onto the axis
+	float tmin = 1e30f, tmax = -1e30f;
+	float len2 = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+	for (int p=0; p<16; ++p){
+		float t = ((block[4*p]-mean[0])*axis[0] + (block[4*p+1]-mean[1])*axis[1] + (block[4*p+2]-mean[2])*axis[2])/len2;
+		tmin = min(tmin, t); tmax = max(tmax, t);
+	}
+	float e0[3], e1[3];
+	for (int c=0; c<3; ++c){ e0[c] = mean[c] + tmax*axis[c]; e1[c] = mean[c] + tmin*axis[c]; }
+	unsigned short c0 = pack565(e0), c1 = pack565(e1);
+	if (c0 < c1) swap(c0, c1);
+	
+	unsigned int indices = 0;
+	if (c0 != c1){
+		int pal[4][3];
+		unpack565(c0, pal[0]);
+		unpack565(c1, pal[1]);
+		for (int c=0; c<3; ++c){
+			pal[2][c] = (2*pal[0][c] + pal[1][c])/3;
+			pal[3][c] = (pal[0][c] + 2*pal[1][c])/3;
+		}
+		for (int p=0; p<16; ++p){
+			int best = 0, bestErr = 1<<30;
+			for (int k=0; k<4; ++k){
+				int dr = block[4*p]-pal[k][0], dg = block[4*p+1]-pal[k][1], db = block[4*p+2]-pal[k][2];
+				int err = dr*dr + dg*dg + db*db;
+				if (err < bestErr){ bestErr = err; best = k; }
+			}
+			indices |= best << (2*p);
+		}
+	}
+	
+	out[0] = c0 & 0xFF; out[1] = c0 >> 8;
+	out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+	for (int k=0; k<4; ++k) out[4+k] = (indices >> (8*k)) & 0xFF;
+}
+
+// 8 byte alpha block of BC3 in 8-alpha mode (alpha0 > alpha1)
+static void encodeAlphaBlock(const unsigned char block[64], unsigned char * out){
+	int a0 = 0, a1 = 255;
+	for (int p=0; p<16; ++p){ a0 = max(a0, int(block[4*p+3])); a1 = min(a1, int(block[4*p+3])); }
+	
+	unsigned long long indices = 0;
+	if (a0 != a1){
+		int pal[8] = {a0, a1};
+		for (int i=2; i<8; ++i) pal[i] = ((8-i)*a0 + (i-1)*a1)/7;
+		for (int p=0; p<16; ++p){
+			int best = 0, bestErr = 1<<30;
+			for (int k=0; k<8; ++k){
+				int err = abs(block[4*p+3] - pal[k]);
+				if (err < bestErr){ bestErr = err; best = k; }
+			}
+			indices |= (unsigned long long)best << (3*p);
+		}
+	}
+	
+	out[0] = a0; out[1] = a1;
+	for (int k=0; k<6; ++k) out[2+k] = (indices >> (8*k)) & 0xFF;
+}
+
+
+void compressBC1(const unsigned char * rgba, int w, int h, unsigned char * out){
+	unsigned char block[64];
+	for (int y=0; y<h; y += 4){
+		for (int x=0; x<w; x += 4){
+			fetchBlock(rgba, w, h, x, y, block);
+			encodeColorBlock(block, out);
+			out += 8;
+		}
+	}
+}
+
+void compressBC3(const unsigned char * rgba, int w, int h, unsigned char * out){
+	unsigned char block[64];
+	for (int y=0; y<h; y += 4){
+		for (int x=0; x<w; x += 4){
+			fetchBlock(rgba, w, h, x, y, block);
+			encodeAlphaBlock(block, out);
+			encodeColorBlock(block, out+8);
+			out += 16;
+		}
+	}
+}
@@ -0,0 +1,129 @@
+#include "../headers/camera.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../glm/gtc/matrix_transform.hpp"
+using namespace std;
+
+// ===========================================================
+// class Camera
+// ===========================================================
+
+Camera::Camera(){
+	view = glm::mat4(1.f);
+	xmin = ymin = -1;
+	xmax = ymax = 1;
+	znear = -10;
+	zfar = 110;
+	minWidth = 1e-3;
+	maxWidth = 1e7;
+	smoothing = 0.08;
+	b_animating = false;
+	animTimer.reset();
+	setViewport(0, 0, 1, 1, 1, 1);
+	updateProjection();
+}
+
+void Camera::setView(const glm::mat4 &v){
+	view = v;
+	updateProducts();
+}
+
+void Camera::setProjection(const glm::mat4 &p){
+	projection = p;
+	updateProducts();
+}
+
+void Camera::setViewport(int x, int y, int w, int h, int winWidth, int winHeight){
+	viewport[0] = x; viewport[1] = y;
+	viewport[2] = max(w, 1); viewport[3] = max(h, 1);
+	windowWidth = winWidth;
+	windowHeight = winHeight;
+}
+
+void Camera::updateProjection(){
+	projection = glm::ortho(xmin, xmax, ymin, ymax, znear, zfar);
+	updateProducts();
+}
+
+void Camera::updateProducts(){
+	viewProjection = projection*view;
+	inverseViewProjection = glm::inverse(viewProjection);
+}
+
+
+glm::vec2 Camera::screenToWorld(float x, float y){
+	float xndc = 2*(x - viewport[0])/viewport[2] - 1;
+	float yndc = 2*(windowHeight - y - viewport[1])/viewport[3] - 1;
+	glm::vec4 p = inverseViewProjection*glm::vec4(xndc, yndc, 0.f, 1.f);
+	return glm::vec2(p.x, p.y);
+}
+
+
+void Camera::showRect(float x0, float x1, float y0, float y1){
+	xmin = target[0] = x0; xmax = target[1] = x1;
+	ymin = target[2] = y0; ymax = target[3] = y1;
+	b_animating = false;
+	updateProjection();
+}
+
+// an ongoing zoom moves along, so that the canvas follows the cursor during the animation too
+void Camera::pan(float dx, float dy){
+	float wx = dx*(xmax-xmin)/viewport[2];
+	float wy = dy*(ymax-ymin)/viewport[3];
+	xmin -= wx; xmax -= wx;
+	ymin += wy; ymax += wy;		// window y goes down
+	target[0] -= wx; target[1] -= wx;
+	target[2] += wy; target[3] += wy;
+	updateProjection();
+}
+
+// The new rectangle is the target of an ongoing zoom scaled by 1/factor, placed so that
+// the point now under the cursor ends up under it again.
+void Camera::zoomAt(float x, float y, float factor, bool animated){
+	float u = (x - viewport[0])/viewport[2];
+	float v = (windowHeight - y - viewport[1])/float(viewport[3]);
+	float ax = xmin + u*(xmax-xmin);
+	float ay = ymin + v*(ymax-ymin);
+
+	float base[4] = {xmin, xmax, ymin, ymax};
+	if (b_animating) copy(target, target+4, base);
+	float w = (base[1]-base[0])/factor, h = (base[3]-base[2])/factor;
+	float s = 1;
+	if (w < minWidth) s = minWidth/w;
+	if (w > maxWidth) s = maxWidth/w;
+	w *= s; h *= s;
+
+	target[0] = ax - u*w; target[1] = target[0] + w;
+	target[2] = ay - v*h; target[3] = target[2] + h;
+	if (animated && smoothing > 0){
+		if (!b_animating) animTimer.start();
+		b_animating = true;
+	}
+	else showRect(target[0], target[1], target[2], target[3]);
+}
+
+// exponential approach, independent of the frame rate; ends within a tenth of a pixel of the target
+bool Camera::animate(){
+	if (!b_animating) return false;
+	float dt = animTimer.getTime()/1000;
+	animTimer.start();
+	float a = 1 - exp(-dt/smoothing);
+
+	float r[4] = {xmin, xmax, ymin, ymax};
+	float eps = 0.1f*(target[1]-target[0])/viewport[2];
+	bool done = true;
+	for (int k=0; k<4; ++k){
+		r[k] += (target[k]-r[k])*a;
+		if (fabs(target[k]-r[k]) > eps) done = false;
+	}
+	if (done){
+		showRect(target[0], target[1], target[2], target[3]);
+		return false;
+	}
+	xmin = r[0]; xmax = r[1];
+	ymin = r[2]; ymax = r[3];
+	updateProjection();
+	return true;
+}
@@ -0,0 +1,117 @@
+#include "../headers/color_convert.h"
+
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YCC_X86 1
+#endif
+using namespace std;
+
+// JFIF YCbCr -> RGB in 16 bit fixed point, with cb, cr centred on 0:
+//   R = Y + 1.402 cr  =  Y + cr + 0.402 cr
+//   G = Y - 0.344136 cb - 0.714136 cr  =  Y - 0.344136 cb - cr + 0.285864 cr
+//   B = Y + 1.772 cb  =  Y + 2 cb - 0.228 cb
+// Every factor is below 0.5 so that it fits a signed 16 bit multiplier,
+// and mulhi() is the high half of the product, as _mm_mulhi_epi16 gives it.
+// All paths use the same arithmetic and produce identical results.
+static const int K_RCR = 26345;		// 0.402    * 65536
+static const int K_GCB = 22554;		// 0.344136 * 65536
+static const int K_GCR = 18734;		// 0.285864 * 65536
+static const int K_BCB = 14942;		// 0.228    * 65536
+
+static inline int mulhi(int a, int k){
+	return (a*k) >> 16;
+}
+
+static inline unsigned char clampByte(int v){
+	return (unsigned char)min(max(v, 0), 255);
+}
+
+static void yccToRGBAScalar(const unsigned char * ycc, int n, unsigned char * rgba){
+	for (int i=0; i<n; ++i){
+		int y = ycc[3*i], cb = ycc[3*i+1]-128, cr = ycc[3*i+2]-128;
+		rgba[4*i+0] = clampByte(y + cr + mulhi(cr, K_RCR));
+		rgba[4*i+1] = clampByte(y - mulhi(cb, K_GCB) - cr + mulhi(cr, K_GCR));
+		rgba[4*i+2] = clampByte(y + 2*cb - mulhi(cb, K_BCB));
+		rgba[4*i+3] = 255;
+	}
+}
+
+
+#ifdef YCC_X86
+
+// 8 pixels per step. The bytes are split into planes first, the rest stays in registers:
+// R,B and G,A are packed to bytes side by side and interleaved into RGBA by two unpacks.
+__attribute__((target("sse2")))
+static void yccToRGBASSE2(const unsigned char * ycc, int n, unsigned char * rgba){
+	const __m128i k128 = _mm_set1_epi16(128), alpha = _mm_set1_epi16(255);
+	const __m128i kRcr = _mm_set1_epi16(K_RCR), kGcb = _mm_set1_epi16(K_GCB);
+	const __m128i kGcr = _mm_set1_epi16(K_GCR), kBcb = _mm_set1_epi16(K_BCB);
+	short y[8], cb[8], cr[8];
+	int i = 0;
+	for (; i+8 <= n; i += 8){
+		const unsigned char * s = ycc + 3*i;
+		for (int k=0; k<8; ++k){ y[k] = s[3*k]; cb[k] = s[3*k+1]; cr[k] = s[3*k+2]; }
+		__m128i Y  = _mm_loadu_si128((const __m128i*)y);
+		__m128i Cb = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)cb), k128);
+		__m128i Cr = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)cr), k128);
+
+		__m128i R = _mm_add_epi16(_mm_add_epi16(Y, Cr), _mm_mulhi_epi16(Cr, kRcr));
+		__m128i G = _mm_add_epi16(_mm_sub_epi16(_mm_sub_epi16(Y, _mm_mulhi_epi16(Cb, kGcb)), Cr), _mm_mulhi_epi16(Cr, kGcr));
+		__m128i B = _mm_sub_epi16(_mm_add_epi16(Y, _mm_add_epi16(Cb, Cb)), _mm_mulhi_epi16(Cb, kBcb));
+
+		__m128i rb = _mm_packus_epi16(R, B), ga = _mm_packus_epi16(G, alpha);	// R0..7 B0..7, G0..7 A0..7
+		__m128i rg = _mm_unpacklo_epi8(rb, ga), ba = _mm_unpackhi_epi8(rb, ga);
+		_mm_storeu_si128((__m128i*)(rgba + 4*i),      _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i*)(rgba + 4*i + 16), _mm_unpackhi_epi16(rg, ba));
+	}
+	yccToRGBAScalar(ycc + 3*i, n-i, rgba + 4*i);
+}
+
+// as above, 16 pixels per step; the packs and unpacks work within 128 bit lanes,
+// which leaves pixels 0-3, 8-11 and 4-7, 12-15 to be put back in order
+__attribute__((target("avx2")))
+static void yccToRGBAAVX2(const unsigned char * ycc, int n, unsigned char * rgba){
+	const __m256i k128 = _mm256_set1_epi16(128), alpha = _mm256_set1_epi16(255);
+	const __m256i kRcr = _mm256_set1_epi16(K_RCR), kGcb = _mm256_set1_epi16(K_GCB);
+	const __m256i kGcr = _mm256_set1_epi16(K_GCR), kBcb = _mm256_set1_epi16(K_BCB);
+	short y[16], cb[16], cr[16];
+	int i = 0;
+	for (; i+16 <= n; i += 16){
+		const unsigned char * s = ycc + 3*i;
+		for (int k=0; k<16; ++k){ y[k] = s[3*k]; cb[k] = s[3*k+1]; cr[k] = s[3*k+2]; }
+		__m256i Y  = _mm256_loadu_si256((const __m256i*)y);
+		__m256i Cb = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)cb), k128);
+		__m256i Cr = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)cr), k128);
+
+		__m256i R = _mm256_add_epi16(_mm256_add_epi16(Y, Cr), _mm256_mulhi_epi16(Cr, kRcr));
+		__m256i G = _mm256_add_epi16(_mm256_sub_epi16(_mm256_sub_epi16(Y, _mm256_mulhi_epi16(Cb, kGcb)), Cr), _mm256_mulhi_epi16(Cr, kGcr));
+		__m256i B = _mm256_sub_epi16(_mm256_add_epi16(Y, _mm256_add_epi16(Cb, Cb)), _mm256_mulhi_epi16(Cb, kBcb));
+
+		__m256i rb = _mm256_packus_epi16(R, B), ga = _mm256_packus_epi16(G, alpha);
+		__m256i rg = _mm256_unpacklo_epi8(rb, ga), ba = _mm256_unpackhi_epi8(rb, ga);
+		__m256i lo = _mm256_unpacklo_epi16(rg, ba), hi = _mm256_unpackhi_epi16(rg, ba);	// pixels 0-3 | 8-11, 4-7 | 12-15
+		_mm256_storeu_si256((__m256i*)(rgba + 4*i),      _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(rgba + 4*i + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	yccToRGBAScalar(ycc + 3*i, n-i, rgba + 4*i);
+}
+
+#endif
+
+
+typedef void (*YccConverter)(const unsigned char *, int, unsigned char *);
+
+static YccConverter chooseConverter(){
+#ifdef YCC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return yccToRGBAAVX2;
+	if (__builtin_cpu_supports("sse2")) return yccToRGBASSE2;
+#endif
+	return yccToRGBAScalar;
+}
+
+void yccToRGBA(const unsigned char * ycc, int n, unsigned char * rgba){
+	static const YccConverter convert = chooseConverter();
+	convert(ycc, n, rgba);
+}
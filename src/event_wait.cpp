@@ -0,0 +1,29 @@
+// Kept out of graphics.cpp because Xlib's Time typedef collides with UpdateMode::Time
+
+#include <sys/select.h>
+#include <algorithm>
+#include <GL/glx.h>
+
+void waitForWindowEvents(int timeout_ms, int wakeFd){
+	Display * dpy = glXGetCurrentDisplay();
+	if (dpy != NULL && XPending(dpy)) return;	// events already queued by Xlib
+	
+	fd_set fds;
+	FD_ZERO(&fds);
+	int nfds = 0;
+	if (dpy != NULL){
+		int fd = ConnectionNumber(dpy);
+		FD_SET(fd, &fds);
+		nfds = std::max(nfds, fd+1);
+	}
+	if (wakeFd >= 0){
+		FD_SET(wakeFd, &fds);
+		nfds = std::max(nfds, wakeFd+1);
+	}
+	if (nfds == 0) return;
+	
+	timeval tv;
+	tv.tv_sec = timeout_ms/1000;
+	tv.tv_usec = (timeout_ms%1000)*1000;
+	select(nfds, &fds, NULL, NULL, (timeout_ms < 0)? NULL : &tv);
+}
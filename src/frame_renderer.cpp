@@ -0,0 +1,131 @@
+#include "../headers/graphics.h"
+
+#include <algorithm>
+#include <cstddef>
+using namespace std;
+
+// ===========================================================
+// class FrameRenderer
+// ===========================================================
+
+void FrameRenderer::init(){
+	program = acquireProgram("frame");
+	
+	float verts[] = {	// unit quad
+		1, 1,
+		0, 1,
+		0, 0,
+		1, 0
+	};	
+	float UVs[] = {		// mirrorred along y
+	   1.0f, 0.0f,
+	   0.0f, 0.0f,
+	   0.0f, 1.0f,
+	   1.0f, 1.0f
+	};
+	int tess_ids[] = {0,1,2,2,3,0};
+	
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	
+	// quad vertices and UVs go into one buffer: 4 positions followed by 4 UVs
+	glGenBuffers(1, &quad_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(verts)+sizeof(UVs), NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(verts), verts);
+	glBufferSubData(GL_ARRAY_BUFFER, sizeof(verts), sizeof(UVs), UVs);
+	glVertexAttribPointer(ATTR_POS, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glVertexAttribPointer(ATTR_UV,  2, GL_FLOAT, GL_FALSE, 0, (void*)sizeof(verts));
+	glEnableVertexAttribArray(ATTR_POS);
+	glEnableVertexAttribArray(ATTR_UV);
+	
+	glGenBuffers(1, &quad_ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quad_ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(tess_ids), tess_ids, GL_STATIC_DRAW);
+	
+	// instance attributes advance once per frame
+	capacity = 256;
+	glGenBuffers(1, &instance_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(FrameInstance), NULL, GL_STREAM_DRAW);
+	setInstanceOffset(0);
+	glVertexAttribDivisor(ATTR_RECT, 1);
+	glVertexAttribDivisor(ATTR_UVRECT, 1);
+	glVertexAttribDivisor(ATTR_ZSLICE, 1);
+	glEnableVertexAttribArray(ATTR_RECT);
+	glEnableVertexAttribArray(ATTR_UVRECT);
+	glEnableVertexAttribArray(ATTR_ZSLICE);
+	
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void FrameRenderer::destroy(){
+	glDeleteBuffers(1, &instance_vbo);
+	glDeleteBuffers(1, &quad_ebo);
+	glDeleteBuffers(1, &quad_vbo);
+	glDeleteVertexArrays(1, &vao);
+	releaseProgram(program);
+}
+
+
+// point the instance attributes at instance number 'first' (instance_vbo must be bound)
+void FrameRenderer::setInstanceOffset(int first){
+	size_t base = first*sizeof(FrameInstance);
+	glVertexAttribPointer(ATTR_RECT,   4, GL_FLOAT, GL_FALSE, sizeof(FrameInstance), (void*)(base + offsetof(FrameInstance, rect)));
+	glVertexAttribPointer(ATTR_UVRECT, 4, GL_FLOAT, GL_FALSE, sizeof(FrameInstance), (void*)(base + offsetof(FrameInstance, uvRect)));
+	glVertexAttribPointer(ATTR_ZSLICE, 2, GL_FLOAT, GL_FALSE, sizeof(FrameInstance), (void*)(base + offsetof(FrameInstance, zSlice)));
+}
+
+
+void FrameRenderer::submit(Frame * f){
+	FrameInstance inst;
+	inst.rect   = glm::vec4(f->x0, f->y0, f->x1, f->y1);
+	// the frame's crop is relative to the image, which occupies slot->uvRect of the layer
+	glm::vec4 s = f->slot->uvRect, c = f->uvRect;
+	inst.uvRect = glm::vec4(s.x + c.x*s.z, s.y + c.y*s.w, c.z*s.z, c.w*s.w);
+	inst.zSlice = glm::vec2(0.1f*f->layer, f->slot->layer);
+	submit(inst, f->slot->tex);	// the pool may have moved the image since f->tex was set
+}
+
+void FrameRenderer::submit(const FrameInstance &inst, GLuint tex){
+	instances.push_back(inst);
+	textures.push_back(tex);
+}
+
+
+void FrameRenderer::flush(ShaderProgram * prog, GLuint firstId){
+	if (instances.empty()) return;
+	if (prog == NULL) prog = program;
+	GLint loc_firstId = prog->uniformLocation("firstId");
+	
+	glRenderer->state.useProgram(prog->program_id);
+	glRenderer->state.bindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+	
+	// grow the instance buffer if needed, otherwise orphan the old storage so the driver need not wait for it
+	while (capacity < instances.size()) capacity *= 2;
+	glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(FrameInstance), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instances.size()*sizeof(FrameInstance), &instances[0]);
+	
+	// consecutive instances sharing a texture array are one draw call. The render queue 
+	// sorts frames by texture, except where the layer order of transparent frames matters.
+	int first = 0;
+	while (first < instances.size()){
+		int last = first+1;
+		while (last < instances.size() && textures[last] == textures[first]) ++last;
+		
+		setInstanceOffset(first);
+		if (loc_firstId >= 0) glUniform1ui(loc_firstId, firstId + first);	// gl_InstanceID restarts at 0 in every draw
+		glRenderer->state.bindTexture(GL_TEXTURE_2D_ARRAY, textures[first]);
+		glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, (void *)0, last-first);
+		++glRenderer->state.nDrawCalls;
+		first = last;
+	}
+	
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	instances.clear();
+	textures.clear();
+}
+
@@ -21,7 +21,8 @@ void printError(const char *context)
 void printStatus(const char *step, GLuint context, GLuint status)
 {
   GLint result = GL_FALSE;
-  glGetShaderiv(context, status, &result);
+  if (status == GL_LINK_STATUS) glGetProgramiv(context, status, &result);
+  else                          glGetShaderiv(context, status, &result);
   if (result == GL_FALSE) {
     char buffer[1024];
     if (status == GL_COMPILE_STATUS)
@@ -33,10 +34,16 @@ void printStatus(const char *step, GLuint context, GLuint status)
   };
 }
 
-void loadShader(string filename, GLuint &shader_id, GLenum shader_type){
+void loadShader(string filename, GLuint &shader_id, GLenum shader_type, string defines){
 
 	ifstream fin(filename.c_str());
 	string c((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+	
+	// defines must follow the #version directive, which has to be the first line
+	if (defines != ""){
+		size_t pos = (c.compare(0, 8, "#version") == 0)? c.find('\n')+1 : 0;
+		c.insert(pos, defines);
+	}
 	const char * glsl_src = c.c_str();
 
 	shader_id = glCreateShader(shader_type);
@@ -47,71 +54,149 @@ void loadShader(string filename, GLuint &shader_id, GLenum shader_type){
 }
 
 
-void Shape::createShaders(){
-	GLenum ErrorCheckValue = glGetError();
+// ===========================================================
+// class ShaderProgram and the program cache
+// ===========================================================
+
+ShaderProgram::ShaderProgram(string _name, string _variant){
+	name = _name;
+	variant = _variant;
+	refCount = 0;
 
-//	cout << "creating shaders from " << vertexShaderFile << endl; 
+	string defines = "";
+	vector <string> macros = parse(variant);
+	for (int i=0; i<macros.size(); ++i) if (macros[i] != "") defines += "#define " + macros[i] + "\n";
 
-	loadShader(vertexShaderFile, vertexShader_id, GL_VERTEX_SHADER);	
-	loadShader(fragmentShaderFile, fragmentShader_id, GL_FRAGMENT_SHADER);
+	GLuint vertexShader_id, fragmentShader_id;
+	loadShader("src/shaders/shader_vertex_" + name + ".glsl", vertexShader_id, GL_VERTEX_SHADER, defines);	
+	loadShader("src/shaders/shader_fragment_" + name + ".glsl", fragmentShader_id, GL_FRAGMENT_SHADER, defines);
 
 	program_id = glCreateProgram();
 	glAttachShader(program_id, vertexShader_id);
 	glAttachShader(program_id, fragmentShader_id);
+	glBindAttribLocation(program_id, ATTR_POS, "in_pos");	// explicit layout(location) in the shader takes precedence
+	glBindAttribLocation(program_id, ATTR_COL, "in_col");
+	glBindAttribLocation(program_id, ATTR_UV,  "in_UV");
 	glLinkProgram(program_id);
-	printStatus("link shader", program_id, GL_LINK_STATUS);
+	printStatus(("link shader " + name).c_str(), program_id, GL_LINK_STATUS);
 
+	// shaders are flagged for deletion and go away with the program
+	glDetachShader(program_id, vertexShader_id);
+	glDetachShader(program_id, fragmentShader_id);
 	glDeleteShader(fragmentShader_id);
 	glDeleteShader(vertexShader_id);
 	
-//	ErrorCheckValue = glGetError();
-//	if (ErrorCheckValue != GL_NO_ERROR){
-//		cout << "ERROR: Could not create the shaders: " << gluErrorString(ErrorCheckValue) << endl;
-//	}
+	resolveBindings();
+}
 
-//	cout << "DONE." << endl;
+void ShaderProgram::resolveBindings(){
+	GLint nUniforms = 0;
+	glGetProgramiv(program_id, GL_ACTIVE_UNIFORMS, &nUniforms);
+	for (int i=0; i<nUniforms; ++i){
+		char buffer[256];
+		GLint size; GLenum type;
+		glGetActiveUniform(program_id, i, 256, NULL, &size, &type, buffer);
+		GLint loc = glGetUniformLocation(program_id, buffer);
+		if (loc < 0) continue;	// member of a uniform block
+		string s(buffer);
+		if (s.size() > 3 && s.substr(s.size()-3) == "[0]") s = s.substr(0, s.size()-3);
+		uniforms[s] = loc;
+	}
+	
+	loc_model = uniformLocation("model");
+	loc_psize = uniformLocation("psize");
+	loc_tex   = uniformLocation("tex");
+	
+	camera_block = glGetUniformBlockIndex(program_id, "Camera");
+	if (camera_block != GL_INVALID_INDEX) glUniformBlockBinding(program_id, camera_block, CAMERA_UBO_BINDING);
+
+	// samplers never change unit, so set them once here
+	if (loc_tex >= 0){
+		glUseProgram(program_id);
+		glUniform1i(loc_tex, 0);
+		glUseProgram(0);
+	}
 }
 
+GLint ShaderProgram::uniformLocation(const string& s){
+	map <string, GLint>::iterator it = uniforms.find(s);
+	return (it == uniforms.end())? -1 : it->second;
+}
 
-void Shape::deleteShaders(){
-	glUseProgram(0);
+ShaderProgram::~ShaderProgram(){
+	glDeleteProgram(program_id);
+}
 
-	glDetachShader(program_id, vertexShader_id);
-	glDetachShader(program_id, fragmentShader_id);
 
-//	glDeleteShader(fragmentShader_id);
-//	glDeleteShader(vertexShader_id);
+static map <string, ShaderProgram*> programCache;	// key is name|variant
 
-	glDeleteProgram(program_id);
+ShaderProgram * acquireProgram(string name, string variant){
+	string key = name + "|" + variant;
+	map <string, ShaderProgram*>::iterator it = programCache.find(key);
+	ShaderProgram * prog;
+	if (it == programCache.end()){
+		prog = new ShaderProgram(name, variant);
+		programCache[key] = prog;
+	}
+	else prog = it->second;
+	
+	++prog->refCount;
+	return prog;
+}
+
+// Programs are kept in the cache even when unreferenced, so that transient shapes 
+// (e.g. the selection box) do not trigger a recompile. Use deleteUnusedPrograms() to free them.
+void releaseProgram(ShaderProgram * prog){
+	if (prog != NULL) --prog->refCount;
+}
+
+void deleteUnusedPrograms(){
+	map <string, ShaderProgram*>::iterator it = programCache.begin();
+	while (it != programCache.end()){
+		if (it->second->refCount <= 0){
+			delete it->second;
+			programCache.erase(it++);
+		}
+		else ++it;
+	}
+}
+
+
+void Shape::createShaders(){
+	program = acquireProgram(shaderName);
+	program_id = program->program_id;
+}
+
+
+void Shape::deleteShaders(){
+	glUseProgram(0);
+	releaseProgram(program);
+	program = NULL;
+	program_id = 0;
 }
 
 void Shape::useProgram(){
-	glUseProgram(program_id);
+	glRenderer->state.useProgram(program_id);
 }
 
-void Shape::setRenderVariable(string s, float  f){
-	GLuint loc = glGetUniformLocation(program_id, s.c_str());
-	glUniform1f(loc, f);
+void Shape::setRenderVariable(const string& s, float  f){
+	glUniform1f(program->uniformLocation(s), f);
 }
 
-void Shape::setRenderVariable(string s, glm::vec2 f){
-	GLuint loc = glGetUniformLocation(program_id, s.c_str());
-	glUniform2f(loc, f.x, f.y);
+void Shape::setRenderVariable(const string& s, glm::vec2 f){
+	glUniform2f(program->uniformLocation(s), f.x, f.y);
 }
 
-void Shape::setRenderVariable(string s, glm::vec3 f){
-	GLuint loc = glGetUniformLocation(program_id, s.c_str());
-	glUniform3f(loc, f.x, f.y, f.z);
+void Shape::setRenderVariable(const string& s, glm::vec3 f){
+	glUniform3f(program->uniformLocation(s), f.x, f.y, f.z);
 }
 
-void Shape::setRenderVariable(string s, glm::vec4 f){
-	GLuint loc = glGetUniformLocation(program_id, s.c_str());
-	glUniform4f(loc, f.x, f.y, f.z, f.w);
+void Shape::setRenderVariable(const string& s, glm::vec4 f){
+	glUniform4f(program->uniformLocation(s), f.x, f.y, f.z, f.w);
 }
 
-void Shape::setShaderVariable(string s, glm::mat4 f){
-	GLuint loc = glGetUniformLocation(program_id, s.c_str());
-	glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(f));
+void Shape::setShaderVariable(const string& s, glm::mat4 f){
+	glUniformMatrix4fv(program->uniformLocation(s), 1, GL_FALSE, glm::value_ptr(f));
 }
 
 // ===========================================================
@@ -276,34 +361,64 @@ Shape::Shape(int nVert, int components_per_vertex, string _type, string shader_n
 	
 	if (shader_name == "") shader_name = as_string(dim) + "dpt";
 	
-	vertexShaderFile = "src/shaders/shader_vertex_" + shader_name + ".glsl";
-	fragmentShaderFile = "src/shaders/shader_fragment_" + shader_name + ".glsl";
-	createShaders();
+	shaderName = shader_name;
+	// shapes without own vertices (e.g. Frames, which use the shared quad and program of the FrameRenderer) get no program and no buffers
+	program = NULL;
+	program_id = 0;
+	if (nVert > 0) createShaders();
 
 	type = _type;
 	nVertices = nVert;
 	model = glm::mat4(1.0f);
 	pointSize = 1;
 	textured = false;
+	layer = 0;
+	blendMode = BlendAlpha;
+	b_pickable = true;
+	b_export = true;
+
+	vao = vbo = cbo = ebo = tbo = 0;
+	tex = 0;
+	texWidth = texHeight = 0;
+	if (nVertices > 0) createBuffers();
+
+	glRenderer->addShape(this);
+	
+	b_render = ren;
+}
+
+
+void Shape::createBuffers(){
+	// the VAO records the attribute layout once, so that render() only has to bind it
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
 
 	// create vertex buffer
 	glGenBuffers(1, &vbo);					// create buffer ids and store in array
 	glBindBuffer(GL_ARRAY_BUFFER, vbo); 	// Bring buffer into current openGL context
 	glBufferData(GL_ARRAY_BUFFER, dim*sizeof(float)*nVertices, NULL, GL_DYNAMIC_DRAW); 
+	glVertexAttribPointer(ATTR_POS, dim, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(ATTR_POS);
 
 	// create color buffer
 	glGenBuffers(1, &cbo);
 	glBindBuffer(GL_ARRAY_BUFFER, cbo); 	// Bring buffer into current openGL context
 	glBufferData(GL_ARRAY_BUFFER, 4*sizeof(float)*nVertices, NULL, GL_DYNAMIC_DRAW); 
+	glVertexAttribPointer(ATTR_COL, 4, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(ATTR_COL);
+	
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	
 	glGenBuffers(1, &ebo);
+	
+	// UV buffer, filled by applyTexture()
 	glGenBuffers(1, &tbo);
+	glBindBuffer(GL_ARRAY_BUFFER, tbo);
+	glBufferData(GL_ARRAY_BUFFER, 2*sizeof(float)*nVertices, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	
 	glGenTextures(1, &tex);
-
-	glRenderer->addShape(this);
-	
-	b_render = ren;
 }
 
 
@@ -329,12 +444,15 @@ Shape::~Shape(){
 //	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glDeleteBuffers(1, &tbo);
 	
+	glDeleteVertexArrays(1, &vao);
+	
 	glRenderer->removeShape(this);
 	
 }
 
 void Shape::setVertices(void* data){
-
+	if (vbo == 0) return;	// no buffers of its own, e.g. a Frame
+	glRenderer->markDirty();
 	glBindBuffer(GL_ARRAY_BUFFER, vbo); 	// Bring 1st buffer into current openGL context
 	glBufferSubData(GL_ARRAY_BUFFER, 0, dim*sizeof(float)*nVertices, data); 
 	// remove buffers from curent context. (appropriate buffers will be set bu CUDA resources)
@@ -344,6 +462,8 @@ void Shape::setVertices(void* data){
 
 
 void Shape::setColors(float *colData){
+	if (cbo == 0) return;
+	glRenderer->markDirty();
 	glBindBuffer(GL_ARRAY_BUFFER, cbo);
 	glBufferSubData(GL_ARRAY_BUFFER, 0, 4*sizeof(float)*nVertices, colData); 
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -351,63 +471,89 @@ void Shape::setColors(float *colData){
 
 
 void Shape::setElements(int * elements, int n){
+	if (ebo == 0) return;
+	glRenderer->markDirty();
 	// create color buffer
 	nElements = n;
-	glGenBuffers(1, &ebo);
+	glBindVertexArray(vao);							// element buffer binding is part of the VAO state
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo); 	// Bring buffer into current openGL context
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(int)*n, elements, GL_DYNAMIC_DRAW); 
 	//   ^ Not using glBufferSubData here, assuming elements will be set only once.
+	glBindVertexArray(0);
 }
 
 void Shape::applyTexture(float* uvs, unsigned char* pixels, int width, int height){
+	if (tbo == 0) return;
 	textured = true;
 
-	glGenBuffers(1, &tbo);
+	glBindVertexArray(vao);
 	glBindBuffer(GL_ARRAY_BUFFER, tbo);
-	glBufferData(GL_ARRAY_BUFFER, nVertices*2*sizeof(float), uvs, GL_DYNAMIC_DRAW);
-	//   ^ Not using glBufferSubData here, assuming UVs will be set only once.
+	glBufferSubData(GL_ARRAY_BUFFER, 0, nVertices*2*sizeof(float), uvs);
+	glVertexAttribPointer(ATTR_UV, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(ATTR_UV);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+	setTexture(pixels, width, height);
+}
+
+void Shape::setTexture(unsigned char* pixels, int width, int height){
+	if (vao == 0) return;	// a Frame's tex belongs to the texture pool, see Frame::replaceImage()
+	glRenderer->markDirty();
+	textured = true;
+	
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glUniform1i(glGetUniformLocation(program_id, "tex"), 0);
-	//	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 2, 2, 0, GL_RGB, GL_FLOAT, pixels);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels); // After reading one row of texels, pointer advances to next 4 byte boundary. Therefore ALWAYS use 4byte colour types. 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	
+	// immutable storage is kept while the size stays the same, a new size needs a new texture
+	if (width != texWidth || height != texHeight){
+		glDeleteTextures(1, &tex);
+		glGenTextures(1, &tex);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		if (GLEW_ARB_texture_storage) 
+			glTexStorage2D(GL_TEXTURE_2D, mipLevels(width, height), GL_RGBA8, width, height);
+		else 
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		texWidth = width; texHeight = height;
+	}
+	else glBindTexture(GL_TEXTURE_2D, tex);
+	
+	// After reading one row of texels, pointer advances to next 4 byte boundary. Therefore ALWAYS use 4byte colour types. 
+	const unsigned char * src = glRenderer->imageLoader.stageUpload(pixels, size_t(width)*height*4);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, src);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 	glGenerateMipmap(GL_TEXTURE_2D);
 
 }
 
 void Shape::render(){
 
-	if (!b_render) return;
+	if (!b_render || program == NULL) return;
 	
-	useProgram();
+	// draw any frames queued before this shape, to keep the drawing order
+	glRenderer->frameRenderer.flush();
 	
-	// set the point size to match physical scale
-	if (type == "points" ) setRenderVariable("psize", pointSize);
-	if (dim == 3) setShaderVariable("model", glRenderer->projection*glRenderer->view*model);
-	if (dim == 2) setShaderVariable("model", model);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glVertexAttribPointer(glGetAttribLocation(program_id, "in_pos"), dim, GL_FLOAT, GL_FALSE, 0, 0);
-//							^ position of variable in shader         ^components, type        ^ stride and offset     
-	glBindBuffer(GL_ARRAY_BUFFER, cbo);
-	glVertexAttribPointer(glGetAttribLocation(program_id, "in_col"), 4, GL_FLOAT, GL_FALSE, 0, 0);
+	useProgram();
+	draw(program);
+}
 
-	if (textured){
-	glBindBuffer(GL_ARRAY_BUFFER, tbo);
-	glVertexAttribPointer(glGetAttribLocation(program_id, "in_UV"), 2, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	}
+// prog must be in use: the shape's own program, or a variant of it (see IdPicker)
+void Shape::draw(ShaderProgram * prog){
+	// set the point size to match physical scale
+	if (type == "points" ) glUniform1f(prog->loc_psize, pointSize);
 	
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	if (textured)  
-	glEnableVertexAttribArray(2);
+	// 3D programs get view/projection from the camera block. Programs without it get the full transform.
+	if (dim == 3 && prog->camera_block == GL_INVALID_INDEX) 
+		glUniformMatrix4fv(prog->loc_model, 1, GL_FALSE, glm::value_ptr(glRenderer->camera.viewProjection*model));
+	else 
+		glUniformMatrix4fv(prog->loc_model, 1, GL_FALSE, glm::value_ptr(model));
 
+	glRenderer->state.bindVertexArray(vao);
+	if (textured) glRenderer->state.bindTexture(GL_TEXTURE_2D, tex);
+	++glRenderer->state.nDrawCalls;
 
 	if (type == "triangles") 	glDrawElements(GL_TRIANGLES, nElements, GL_UNSIGNED_INT, (void *)0);
 	else if (type == "lines")  	glDrawArrays(GL_LINES, 0, nVertices);
@@ -465,7 +611,7 @@ vector <float> calcExtent(float* data, int nVertices, int dim){
 }
 
 void Shape::autoExtent(float* data){
-
+	glRenderer->markDirty();
 	glm::dvec3 centroid(0.0, 0.0, 0.0); // use double because large accummulation is expected
 	glm::vec3 max(-1e20f, -1e20f, -1e20f);
 	glm::vec3 min(1e20f, 1e20f, 1e20f);
@@ -497,6 +643,7 @@ void Shape::autoExtent(float* data){
 }
 
 void Shape::setExtent(vector <float>& ex){
+	glRenderer->markDirty();
 	model = glm::mat4(1.f);
 	model = glm::scale(model, glm::vec3(ex[9], ex[10], ex[11]));
 	model = glm::translate(model, -glm::vec3(float(ex[0]), float(ex[1]), float(ex[2])));
@@ -509,15 +656,27 @@ void Shape::move(float x0ndc, float y0ndc, float xndc, float yndc){
 Shape2D::Shape2D(int nVert, string _type, string shader_name, bool ren) : Shape(nVert, 2, _type, shader_name, ren) {}
 
 void Shape2D::setExtent(float xmin, float xmax, float ymin, float ymax){
+	glRenderer->markDirty();
 	model = glm::ortho(xmin, xmax, ymin, ymax, 0.f, 100.f);
 }
 
 
+// Frames have no vertex buffers or texture of their own: they are drawn as instances
+// of the unit quad held by the FrameRenderer (see frame_renderer.cpp), and their 
+// image is stored in a layer of the texture pool
 Frame::Frame(float _x0, float _y0, float _x1, float _y1, unsigned char* image, int width, int height)
-	: Shape(4,3,"triangles", "tex"){
+	: Shape(0,3,"triangles"){
 
 	x0 = _x0; y0 = _y0; x1 = _x1; y1 = _y1;
 	layer = 0;
+	uvRect = glm::vec4(0.f, 0.f, 1.f, 1.f);
+	residency = FullRes;
+	residentLimit = glRenderer->texturePool.maxSize;
+	b_loading = b_loadFailed = false;
+	lastUsed = 0;
+	vt = NULL;
+	glRenderer->frameIndex.insert(this);
+	glRenderer->guides.insert(this);
 	
 	model = glm::mat4(1.f);
 	model = glm::translate(model, glm::vec3(x0, y0, 0.f));
@@ -526,34 +685,158 @@ Frame::Frame(float _x0, float _y0, float _x1, float _y1, unsigned char* image, i
 //	glm::vec4 a = model*glm::vec4(1.f,1.f,0.f,1.f);
 //	cout << "Frame Vec:" << a.x << " " << a.y << " " << a.z << " " << a.w << endl;
 	
-	float verts[] = {
-		1, 1, 0,
-		0, 1, 0,
-		0, 0, 0,
-		1, 0, 0
-	};	
+	slot = glRenderer->texturePool.acquire(image, width, height);
+	tex = slot->tex;
+	textured = true;
+	blendMode = imageHasAlpha(image, width, height)? BlendAlpha : BlendOpaque;
+
+}
+
+// The frame shows the loader's placeholder until the decoded image has been uploaded
+Frame::Frame(float _x0, float _y0, float _x1, float _y1, string _filename)
+	: Shape(0,3,"triangles"){
+
+	x0 = _x0; y0 = _y0; x1 = _x1; y1 = _y1;
+	layer = 0;
+	uvRect = glm::vec4(0.f, 0.f, 1.f, 1.f);
+	
+	model = glm::mat4(1.f);
+	model = glm::translate(model, glm::vec3(x0, y0, 0.f));
+	model = glm::scale(model, glm::vec3(x1-x0, y1-y0, 1.f));
+	
+	slot = glRenderer->imageLoader.placeholder;
+	glRenderer->texturePool.retain(slot);
+	tex = slot->tex;
+	textured = true;
+	blendMode = BlendOpaque;
 	
-	int tess_ids[] = {0,1,2,2,3,0};
+	filename = _filename;
+	residency = Evicted;
+	residentLimit = 0;
+	b_loading = b_loadFailed = false;
+	lastUsed = 0;
+	vt = NULL;
+	glRenderer->frameIndex.insert(this);
+	glRenderer->guides.insert(this);
+	glRenderer->residency.add(this);
+	glRenderer->imageLoader.request(this, filename);
+}
 
-//	float UVs[] = {	// unmirrored UVs
-//	   1.0f, 1.0f,
-//	   0.0f, 1.0f,
-//	   0.0f, 0.0f,
-//	   1.0f, 0.0f
-//	};
-	float UVs[] = {	// mirrorred along y
-	   1.0f, 0.0f,
-	   0.0f, 0.0f,
-	   0.0f, 1.0f,
-	   1.0f, 1.0f
-	};
-	setVertices(verts);	
-	setElements(tess_ids, 6);
-	applyTexture(UVs, image, width, height);
+Frame::~Frame(){
+	glRenderer->imageLoader.cancel(this);
+	if (!filename.empty()) glRenderer->residency.remove(this);
+	glRenderer->frameIndex.remove(this);
+	glRenderer->guides.remove(this);
+	delete vt;
+	glRenderer->texturePool.release(slot);
+	tex = 0;	// the array texture belongs to the pool
+}
 
+// A slot of its own is kept and its storage exchanged with s, so that the frame's 
+// handle stays the same as resolutions stream in; a shared slot (the placeholder, or
+// a photo shown by several frames) is let go, and a shared s is taken as is.
+void Frame::setImage(TextureSlot * s, bool hasAlpha){
+	glRenderer->markDirty();
+	if (s == slot){
+		// updated in place
+	}
+	else if (slot->refCount == 1 && s->refCount == 1){
+		glRenderer->texturePool.swapStorage(slot, s);
+	}
+	else {
+		glRenderer->texturePool.retain(s);
+		glRenderer->texturePool.release(slot);
+		slot = s;
+	}
+	tex = slot->tex;
+	blendMode = hasAlpha? BlendAlpha : BlendOpaque;
+}
+
+void Frame::replaceImage(unsigned char* image, int width, int height){
+	glRenderer->imageLoader.cancel(this);
+	if (!filename.empty()){
+		glRenderer->residency.remove(this);	// no longer backed by a file
+		filename = "";
+	}
+	delete vt;
+	vt = NULL;
+	residency = FullRes;
+	residentLimit = glRenderer->texturePool.maxSize;
+	b_loading = b_loadFailed = false;
+	
+	TexturePool &pool = glRenderer->texturePool;
+	int w, h, W, H;
+	pool.sizeClass(width, height, w, h, W, H);
+	unsigned long long hash = hashImage(image, width, height);
+	TextureSlot * s = pool.findShared(hash, w, h);
+	if (s == NULL){
+		if (slot->refCount == 1 && slot->page->width == W && slot->page->height == H && slot->page->format == GL_RGBA8){
+			s = slot;
+			pool.retain(s);
+		}
+		else s = pool.allocate(W, H);
+		
+		vector <unsigned char> levels;
+		vector <size_t> offsets;
+		buildMipChain(image, width, height, w, h, W, H, levels, offsets);
+		const unsigned char * src = glRenderer->imageLoader.stageUpload(&levels[0], levels.size());
+		pool.uploadLevels(s, w, h, src, offsets);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		pool.share(s, hash);
+	}
+	
+	setImage(s, imageHasAlpha(image, width, height));
+	pool.release(s);
+}
+
+void Frame::replaceImage(string _filename){
+	glRenderer->imageLoader.cancel(this);
+	if (filename.empty()) glRenderer->residency.add(this);
+	filename = _filename;
+	b_loadFailed = false;
+	glRenderer->imageLoader.request(this, filename);
+}
+
+void Frame::setUVRect(glm::vec4 r){
+	glRenderer->markDirty();
+	uvRect = r;
+}
+
+// The image needs about as many texels across the shown crop as the frame covers pixels.
+// The aspect of the stored image is the same at any level of detail.
+int Frame::requiredLimit(){
+	glm::mat4 pv = glRenderer->camera.viewProjection;
+	glm::vec4 a = pv*glm::vec4(x0, y0, 0.1f*layer, 1.f);
+	glm::vec4 b = pv*glm::vec4(x1, y1, 0.1f*layer, 1.f);
+	float pw = fabs(b.x/b.w - a.x/a.w)/2*glRenderer->camera.viewport[2];
+	float ph = fabs(b.y/b.w - a.y/a.w)/2*glRenderer->camera.viewport[3];
+	
+	float iw = max(slot->width, 1), ih = max(slot->height, 1), m = max(iw, ih);
+	float need = max(pw/max(uvRect.z, 1e-6f)*m/iw, ph/max(uvRect.w, 1e-6f)*m/ih);
+	
+	int L = glRenderer->imageLoader.thumbSize;
+	while (L < need && L < glRenderer->texturePool.maxSize) L *= 2;
+	return L;
+}
+
+// visible area of the frame in window pixels under the current camera
+float Frame::screenArea(){
+	glm::mat4 pv = glRenderer->camera.viewProjection;
+	glm::vec4 a = pv*glm::vec4(x0, y0, 0.1f*layer, 1.f);
+	glm::vec4 b = pv*glm::vec4(x1, y1, 0.1f*layer, 1.f);
+	float ax = glm::clamp(min(a.x/a.w, b.x/b.w), -1.f, 1.f), bx = glm::clamp(max(a.x/a.w, b.x/b.w), -1.f, 1.f);
+	float ay = glm::clamp(min(a.y/a.w, b.y/b.w), -1.f, 1.f), by = glm::clamp(max(a.y/a.w, b.y/b.w), -1.f, 1.f);
+	return (bx-ax)*(by-ay)/4*glRenderer->camera.viewport[2]*glRenderer->camera.viewport[3];
+}
+
+void Frame::render(){
+	if (!b_render) return;
+	glRenderer->frameRenderer.submit(this);
+	if (vt != NULL) vt->render(this);
 }
 
 void Frame::setExtent(float xmin, float xmax, float ymin, float ymax){
+	glRenderer->markDirty();
 	model = glm::ortho(xmin, xmax, ymin, ymax, 0.f, 100.f);
 }
 
@@ -562,6 +845,7 @@ void Frame::setExtent(float xmin, float xmax, float ymin, float ymax){
 //}
 
 void Frame::setLayer(int l){
+	glRenderer->markDirty();
 //	float verts[] = {
 //		x1, y1, 0.1f*l,
 //		x0, y1, 0.1f*l,
@@ -571,17 +855,21 @@ void Frame::setLayer(int l){
 //	setVertices(verts);	
 	model = glm::translate(model, glm::vec3(0.f, 0.f, 0.1f*(l-layer)));
 	layer = l;
+	glRenderer->frameIndex.update(this);
 //	glm::vec4 a = model*glm::vec4(1.f,1.f,0.f,1.f);
 //	cout << "Frame Vec:" << a.x << " " << a.y << " " << a.z << " " << a.w << endl;
 
 }
 
 void Frame::setSize(float _x0, float _y0, float _x1, float _y1){
+	glRenderer->markDirty();
 	x0 = _x0; y0 = _y0; x1 = _x1; y1 = _y1;
 	model = glm::mat4(1.f);
 	model = glm::translate(model, glm::vec3(x0, y0, 0.f));
 	model = glm::scale(model, glm::vec3(x1-x0, y1-y0, 1.f));
 	model = glm::translate(model, glm::vec3(0.f, 0.f, 0.1f*layer));
+	glRenderer->frameIndex.update(this);
+	glRenderer->guides.update(this);
 
 //	glm::vec4 a = model*glm::vec4(1.f,1.f,0.f,1.f);
 //	cout << "Resized Frame Vec:" << a.x << " " << a.y << " " << a.z << " " << a.w << endl;
@@ -589,15 +877,7 @@ void Frame::setSize(float _x0, float _y0, float _x1, float _y1){
 
 
 float Frame::containsPixel(int x, int y){
-	float winw = glutGet(GLUT_WINDOW_WIDTH);
-	float winh = glutGet(GLUT_WINDOW_HEIGHT);
-	float xndc = 2*x/winw-1;
-	float yndc = 1-2*y/winh;
-//				cout << "xyndc = " << xndc << " " << yndc << endl;
-
-	glm::vec4 p = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(xndc, yndc, 0.f, 1.f);
-//				cout << "world xy = " << p.x << " " << p.y << endl;	
-	
+	glm::vec2 p = glRenderer->camera.screenToWorld(x, y);
 	if (p.x > x0 && p.x < x1 && p.y > y0 && p.y < y1) {
 		return layer;
 	}
@@ -605,14 +885,7 @@ float Frame::containsPixel(int x, int y){
 }
 
 int Frame::cursorLocation(int x, int y){
-	float winw = glutGet(GLUT_WINDOW_WIDTH);
-	float winh = glutGet(GLUT_WINDOW_HEIGHT);
-	float xndc = 2*x/winw-1;
-	float yndc = 1-2*y/winh;
-//				cout << "xyndc = " << xndc << " " << yndc << endl;
-
-	glm::vec4 p = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(xndc, yndc, 0.f, 1.f);
-//				cout << "world xy = " << p.x << " " << p.y << endl;	
+	glm::vec2 p = glRenderer->camera.screenToWorld(x, y);
 
 	float d = 0.5;
 	float ar = (x1-x0)/(y1-y0);
@@ -639,21 +912,22 @@ void Frame::changeCursor(int x, int y){
 }
 
 void Frame::move(float xi, float yi, float xf, float yf){
-//	glm::vec3 p = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(xndc, yndc, 0.f, 1.f);
-//	glm::vec3 p0 = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(x0ndc, y0ndc, 0.f, 1.f);
-//				cout << "world xy = " << p0.x << " " << p0.y << " --> " 
-//					 << p.x << " " << p.y  << endl;	
-
+	glRenderer->markDirty();
 	glm::vec3 dp = glm::vec3(xf,yf,0)-glm::vec3(xi,yi,0);
 	model = glm::translate(model, glm::vec3(dp.x/(x1-x0), dp.y/(y1-y0), 0));
 	x0 += dp.x; x1 += dp.x;
 	y0 += dp.y; y1 += dp.y;
+	glRenderer->frameIndex.update(this);
+	glRenderer->guides.update(this);
 }
 
 
 void Frame::resize(float xi, float yi, float xf, float yf){
+	glRenderer->markDirty();
 	model = glm::scale(model, glm::vec3((xf-x0)/(xi-x0), (yf-y0)/(yi-y0), 1.f));
 	x1 += xf-xi; y1+= yf-yi;
+	glRenderer->frameIndex.update(this);
+	glRenderer->guides.update(this);
 }
 
 // ===========================================================
@@ -677,32 +951,31 @@ void Renderer::init(){
 	viewport_aspect_ratio = 2;
 	
 //	view = glm::translate(glm::mat4(1.0f), glm::vec3(0.f, 0.f, -100.0f) );
-	camera_tx = camera_ty = camera_rx = camera_ry = 0;
-	camera_s = 1;
-
-	view = glm::lookAt(glm::vec3(0.0f, 0.0f, 100.0f), 
-					   glm::vec3(0.0f, 0.0f, 0.0f), 
-					   glm::vec3(0.0f, 1.0f, 0.0f));
+	camera.setView(glm::lookAt(glm::vec3(0.0f, 0.0f, 100.0f), 
+							   glm::vec3(0.0f, 0.0f, 0.0f), 
+							   glm::vec3(0.0f, 1.0f, 0.0f)));
 
  	//projection = glm::perspective(glm::radians(90.0f), float(window_width) / window_height, 0.1f, 1000.0f);
-	projection = glm::ortho(-10.0f, 110.0f, -10.0f, 110.0f, -10.f, 110.0f);
+	camera.znear = -10.f;
+	camera.zfar = 110.f;
+	camera.showRect(-10.0f, 110.0f, -10.0f, 110.0f);
+	camera.setViewport(0, 0, window_width, window_height, window_width, window_height);
 
-	glm::vec4 a = projection*view*glm::vec4(1,0,0,1);
+	glm::vec4 a = camera.viewProjection*glm::vec4(1,0,0,1);
 	cout << "Vec:" << a.x << " " << a.y << " " << a.z << " " << a.w << endl;
 
 	int t = 50; //I.getScalar("dispInterval");
-	if (t < 0) {
-		nSkip = -t;
-		updateMode = Step;
-		displayInterval = 50;	// in this case, only title will be updated in timer function (at 20 fps)
-	}
-	else {
-		displayInterval = t;
-		nSkip = -1;
-		updateMode = Time;
-	}
+	if (t < 0) setUpdateMode(Step, -t);
+	else       setUpdateMode(Time, t);
+	nSteps = stepsSinceDisplay = 0;
+	b_timerArmed = false;
 
 	quality = 3; //I.getScalar("graphicsQual");
+	b_paused = false;
+	b_headless = false;
+	b_exporting = false;
+	offscreen = NULL;
+	b_dirty = true;
 
 	// create colour palettes
 	int n = 100;
@@ -712,16 +985,103 @@ void Renderer::init(){
 }
 
 
+void Renderer::createCameraBuffer(){
+	glGenBuffers(1, &camera_ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, 3*sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_UBO_BINDING, camera_ubo);
+}
+
+void Renderer::updateCameraBuffer(){
+	glm::mat4 cam[3] = {camera.view, camera.projection, camera.viewProjection};	// std140 layout of mat4s is tightly packed
+	glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(cam), cam);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+// Request a redraw. The event loop only draws when something has changed.
+void Renderer::markDirty(){
+	if (b_dirty) return;
+	b_dirty = true;
+	if (!b_headless) glutPostRedisplay();	// headless renders are explicit, see renderOffscreen()
+}
+
+// Draw the scene into the offscreen framebuffer (headless mode) and read it back as 
+// RGBA, top row first. rgba must hold 4*width*height bytes of the framebuffer.
+void Renderer::renderOffscreen(unsigned char * rgba){
+	imageLoader.pump();
+	offscreen->bind();
+	bool zooming = camera.animate();
+	renderScene();
+	if (zooming) markDirty();
+	residency.update();
+	idPicker.refresh();		// after the frame number has advanced
+	offscreen->readPixels(rgba);
+}
+
+
+// Time:    redraw every t ms if the producer has stepped since the last display
+// Step:    redraw after every t producer steps
+// FreeRun: redraw continuously, as fast as buffer swaps allow
+// The timer is armed by step() only, so that an idle window sleeps. In Step and FreeRun 
+// modes it only refreshes the title, at 20 fps.
+void Renderer::setUpdateMode(int mode, int t){
+	updateMode = mode;
+	if (mode == Time){
+		displayInterval = t;
+		nSkip = -1;
+	}
+	else if (mode == Step){
+		nSkip = max(t, 1);
+		displayInterval = 50;
+	}
+	else {
+		nSkip = -1;
+		displayInterval = 50;
+		markDirty();
+	}
+}
+
+// To be called by the producer (e.g. a simulation) after every compute step. 
+// The producer's loop should also call hyperGL_processEvents(false) to let the window draw.
+void Renderer::step(){
+	++nSteps;
+	++stepsSinceDisplay;
+	stepCounter.increment();
+	if (updateMode == Step && !b_paused && stepsSinceDisplay >= nSkip) markDirty();
+	armTimer();
+}
+
+void Renderer::armTimer(){
+	if (b_headless || b_timerArmed) return;
+	b_timerArmed = true;
+	glutTimerFunc(displayInterval, timerEvent, 0);
+}
+
+void Renderer::updateTitle(){
+	if (b_headless) return;
+	string t = makeTitle();
+	if (t == title) return;
+	title = t;
+	glutSetWindowTitle(title.c_str());
+}
+
 int Renderer::getDisplayInterval(){
 	return displayInterval;
 }
 
 int Renderer::addShape(Shape* shp){
+	markDirty();
 	shapes_vec.push_back(shp);
+	return shapes_vec.size()-1;
 }
 
 int Renderer::removeShape(Shape* shp){
+	markDirty();
 	shapes_vec.erase(find(shapes_vec.begin(), shapes_vec.end(), shp));
+	return 0;
 }
 
 void Renderer::togglePause(){
@@ -729,19 +1089,23 @@ void Renderer::togglePause(){
 }
 
 void Renderer::toggleConsole(){
+	markDirty();
 	command = "";
 	b_renderConsole = !b_renderConsole;
 }
 
 void Renderer::toggleText(){
+	markDirty();
 	b_renderText = !b_renderText;
 }
 
 void Renderer::toggleGrid(){
+	markDirty();
 	b_renderGrid = !b_renderGrid;
 }
 
 void Renderer::toggleAxes(){
+	markDirty();
 	b_renderAxes = !b_renderAxes;
 }
 
@@ -781,6 +1145,7 @@ int Renderer::executeCommand(){
 			if (args.size() >= 5){
 				float r = as_float(args[2]), g = as_float(args[3]), b = as_float(args[4]); //, a = as_float(args[5]);
 				glClearColor(r,g,b,1);
+				markDirty();
 			}
 		}
 	}
@@ -788,7 +1153,7 @@ int Renderer::executeCommand(){
 	else{}
 	
 	command = "";
-
+	return 0;
 }
 
 
@@ -796,27 +1161,26 @@ string Renderer::makeTitle(){
     const unsigned char * ver = glGetString(GL_VERSION);
     stringstream sout; 
     sout << fixed << setprecision(1) //<< psys-> N << " Particles" //<< "GL" << ver 
-    								 << ", kcps = " << 100 //psys->kernelCounter.fps
-    								 << ", dcps = " << frameCounter.fps;
+    								 << ", kcps = " << stepCounter.fps
+    								 << ", dcps = " << frameCounter.fps
+    								 << ", draws = " << renderQueue.stats.nDrawCalls;
     								// << ", s = " << psys->igen << "." << psys->istep;
 	return sout.str();
 }
 
 
 
+// With GPU picking, the readback taken at this pixel is used if it has arrived. As hovering
+// requests one at every cursor move, it normally has by the time of a click; otherwise the
+// frameIndex answers, where only frames can be picked, and a readback is started.
 Shape * Renderer::pick(int x, int y){
-	
-	Shape * pickedShape = NULL;
-	float zmax = -1e20;
-	cout << "Contains Pixel: ";
-	for (int i=0; i<glRenderer->shapes_vec.size(); ++i){
-		float z = shapes_vec[i]->containsPixel(x,y);
-		cout << z << " ";
-		if (z != -1e20 && z > zmax && z > 0) pickedShape = shapes_vec[i];
-		zmax = z;
+	Shape * s;
+	if (idPicker.b_enabled){
+		if (idPicker.result(x, y, s)) return s;
+		idPicker.request(x, y);
 	}
-	cout << endl;
-	return pickedShape;
+	glm::vec2 p = camera.screenToWorld(x, y);
+	return frameIndex.topmost(p.x, p.y);
 }
 
 
@@ -844,6 +1208,7 @@ bool init_hyperGL(int *argc, char **argv){
 	
 	glRenderer = new Renderer;
 	glRenderer->init();
+	glRenderer->b_headless = false;
 
 	// init
 	glutInit(argc, argv);
@@ -867,10 +1232,19 @@ bool init_hyperGL(int *argc, char **argv){
 	glutMouseFunc(mousePress);
 	glutMotionFunc(mouseMove);
 	glutPassiveMotionFunc(mouseHover);
+	glutMouseWheelFunc(mouseWheel);
 //	glutIdleFunc(NULL);	// start animation immediately. Otherwise init with NULL	
-	//glutTimerFunc(glRenderer->getDisplayInterval(), timerEvent, 0);
 //	glutCloseFunc(cleanup);
 	
+	initGLState();
+
+//	glViewport(0, 0, glRenderer->window_width, glRenderer->window_height);
+
+    return true;
+}
+
+// GL state and renderer resources, common to the windowed and headless paths
+void initGLState(){
     // default initialization
     glClearColor(0.5, 0.5, 0.5, 0.0);
     glEnable(GL_PROGRAM_POINT_SIZE);
@@ -880,15 +1254,45 @@ bool init_hyperGL(int *argc, char **argv){
 
 	glLineWidth(2);
 
-	glGenVertexArrays(1, &glRenderer->vao_id);
-	glBindVertexArray(glRenderer->vao_id);
+	glRenderer->createCameraBuffer();
+	glRenderer->frameRenderer.init();
+	glRenderer->texturePool.init();
+	glRenderer->mipCache.init();
+	glRenderer->imageLoader.init(&glRenderer->texturePool, &glRenderer->mipCache);
+	glRenderer->idPicker.init();
+}
 
-//	glViewport(0, 0, glRenderer->window_width, glRenderer->window_height);
+// Process pending window events, and draw if the scene is dirty. With block = true and nothing 
+// to draw, sleeps until input arrives or timeout_ms elapses (no timeout if negative).
+void hyperGL_processEvents(bool block, int timeout_ms){
+	glRenderer->imageLoader.pump();	// uploads of decoded images mark the scene dirty
+	glRenderer->idPicker.poll();
+	glutMainLoopEvent();	// dispatches input callbacks, then display() if a redisplay was posted
+	if (!block || glRenderer->b_dirty) return;
+	waitForWindowEvents(timeout_ms, glRenderer->imageLoader.wakeFd());
+}
 
-    return true;
+// Event driven loop: idles without using the CPU, redraws only after a change.
+// Wakes up after a display interval only while the timer is armed.
+void hyperGL_mainLoop(){
+	while(1){
+		hyperGL_processEvents(true, glRenderer->b_timerArmed? glRenderer->getDisplayInterval() : -1);
+	}
 }
 
 void cleanup_hyperGL(){
+	glRenderer->imageLoader.destroy();
+	glRenderer->idPicker.destroy();
+	glRenderer->frameRenderer.destroy();
+	glRenderer->texturePool.destroy();
+	// shapes still alive give up their programs, so that the whole cache is freed
+	for (int i=0; i<glRenderer->shapes_vec.size(); ++i) glRenderer->shapes_vec[i]->deleteShaders();
+	deleteUnusedPrograms();
+	if (glRenderer->offscreen != NULL){		// the context goes last
+		glRenderer->offscreen->destroy();
+		delete glRenderer->offscreen;
+	}
+	if (glRenderer->b_headless) cleanup_hyperGL_headless();
 	delete glRenderer;
 }
 
@@ -896,40 +1300,55 @@ void cleanup_hyperGL(){
 
 // ===================== DISPLAY FUNCTION ====================================//
 
-void display(){
-	
-	//cout << "render..." << endl;
+// draw all shapes into the currently bound framebuffer. Zoom animation, residency and picking
+// follow the frames on screen, so display() and renderOffscreen() advance them, not the tiles
+// of an export.
+void renderScene(){
+	glRenderer->b_dirty = false;	// changes made while drawing will request another frame
+	glRenderer->stepsSinceDisplay = 0;
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	
+	glRenderer->updateCameraBuffer();
 
-//	render all shapes in list
-	for (int i=0; i<glRenderer->shapes_vec.size(); ++i){
-		Shape * s = glRenderer->shapes_vec[i];
-		s->render();
-	}
+//	render all shapes in list, sorted by state
+	glRenderer->renderQueue.build(glRenderer->shapes_vec);
+	glRenderer->renderQueue.submit();
 
 	glRenderer->frameCounter.increment();	// calculate display rate
+}
+
+void display(){
+	
+	//cout << "render..." << endl;
+	bool zooming = glRenderer->camera.animate();	// once per frame on screen, not per export tile or pick pass
+	renderScene();
+	if (zooming) glRenderer->markDirty();		// come back for the next step
+	glRenderer->residency.update();		// on screen frames only, not the tiles of an export
+	glRenderer->idPicker.refresh();		// after the frame number has advanced
+	if (glRenderer->updateMode == FreeRun && !glRenderer->b_paused) glRenderer->markDirty();
 
 //	glutPostRedisplay();
 	glutSwapBuffers();
+	glRenderer->updateTitle();
 
 
 }
 
 // ============================ CALLBACKS ====================================//
 
-//void timerEvent(int value){
-//	
-////	glRenderer->psys->animate();
+void timerEvent(int value){
+	
+//	glRenderer->psys->animate();
 
-//    glutSetWindowTitle(glRenderer->makeTitle().c_str());
+	glRenderer->b_timerArmed = false;	// re-armed by the next step()
+	glRenderer->updateTitle();
 
-//	if (glRenderer->updateMode == Time) glutPostRedisplay();
-//	glutTimerFunc(glRenderer->getDisplayInterval(), timerEvent, 0);
-//}
+	if (glRenderer->updateMode == Time && !glRenderer->b_paused && glRenderer->stepsSinceDisplay > 0) glRenderer->markDirty();
+}
 
 
 void reshape(int w, int h){
-	
+	glRenderer->markDirty();
 	int w0 = glRenderer->window_width;
 	int h0 = glRenderer->window_height;
 	float a = glRenderer->viewport_aspect_ratio;
@@ -941,6 +1360,9 @@ void reshape(int w, int h){
 	int x = min(w,h); 	
     // viewport
     glViewport(fabs(w-w1)/2, fabs(h-h1)/2, w1, h1);
+	glRenderer->camera.setViewport(fabs(w-w1)/2, fabs(h-h1)/2, w1, h1, w, h);
+	glRenderer->window_width = w;
+	glRenderer->window_height = h;
 //	glRenderer->tailLen = glRenderer->tailLen_def * glRenderer->xmax*float(glRenderer->window_height)/float(x);	
 }
 
@@ -979,8 +1401,6 @@ void keyPress(unsigned char key, int x, int y){
 	else{	// console is on. keys will be sent to command buffer.
 		glRenderer->receiveConsoleChar(key);
 	}
-		
-	glutPostRedisplay();
 
 }
 
@@ -989,7 +1409,17 @@ Shape * selectedShape = NULL;
 
 bool lMousePressed, rMousePressed, mMousePressed;
 float mouse_x0=0, mouse_y0=0;
+float zoom_x0=0, zoom_y0=0;		// where the right button went down, the centre of drag zooming
 string mousetransform = "";
+glm::vec4 dragRect;				// x0, y0, x1, y1 the selected frame would have without snapping
+
+// the selection box is drawn in world coordinates around the selected frame
+static void fitSelectionBox(Frame * f){
+	float x0=f->x0, y0=f->y0, x1=f->x1, y1=f->y1;
+	float pos3[] = {x0,y0,100, x1,y0,100, x1,y0,100, x1,y1,100, x1,y1,100, x0,y1,100, x0,y1,100, x0,y0,100};
+	selectionBox->model = glm::mat4(1.f);
+	selectionBox->setVertices(pos3);
+}
 
 void mousePress(int button, int state, int x, int y){
 	switch (button) {
@@ -1011,26 +1441,27 @@ void mousePress(int button, int state, int x, int y){
 //				cout << "xy = " << x << " " << y << endl;
 				// FIXME implement bounding box in Shape itself. update bbox in setVertices. For other computations, apply model matrix to bbox
 				if (selectedShape != NULL){
-					float x0=((Frame*)selectedShape)->x0, 
-						  y0=((Frame*)selectedShape)->y0, 
-						  x1=((Frame*)selectedShape)->x1,
-						  y1=((Frame*)selectedShape)->y1;
-//					cout << "selected shape bounds: " << x0 << " " << y0 << " " << x1 << " " << y1 << endl;
-					float pos3[] = {x0,y0,100, x1,y0,100, x1,y0,100, x1,y1,100, x1,y1,100, x0,y1,100, x0,y1,100, x0,y0,100};
-					float rr=0,gg=0.3,bb=0.3,aa=1;
-					float col3[] = {rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa,
-									rr,gg,bb, aa
-								   };
-					
-					selectionBox = new Shape(8, 3, "lines");
-					selectionBox->setVertices(pos3);
-					selectionBox->setColors(col3);
+					// only frames are dragged and get a selection box; the GPU picker returns any shape
+					Frame * f = dynamic_cast<Frame*>(selectedShape);
+					if (f != NULL){
+						dragRect = glm::vec4(f->x0, f->y0, f->x1, f->y1);
+						float rr=0,gg=0.3,bb=0.3,aa=1;
+						float col3[] = {rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa,
+										rr,gg,bb, aa
+									   };
+						
+						selectionBox = new Shape(8, 3, "lines");
+						selectionBox->b_pickable = false;
+						selectionBox->b_export = false;
+						fitSelectionBox(f);
+						selectionBox->setColors(col3);
+					}
 					
 					selectedShape->changeCursor(x,y);
 					
@@ -1044,6 +1475,7 @@ void mousePress(int button, int state, int x, int y){
 			else{
 				lMousePressed = 0;
 				mousetransform = "";
+				glRenderer->guides.clear();
 //				if (selectedShape != NULL) selectedShape->changeCursor(x,y);
 
 //				if (selectionBox != NULL){
@@ -1067,8 +1499,8 @@ void mousePress(int button, int state, int x, int y){
 		case GLUT_RIGHT_BUTTON:
 			if (state == GLUT_DOWN){
 				rMousePressed = 1;
-				mouse_x0 = x;
-				mouse_y0 = y;
+				mouse_x0 = zoom_x0 = x;
+				mouse_y0 = zoom_y0 = y;
 			}
 			else{
 				rMousePressed = 0;
@@ -1078,20 +1510,23 @@ void mousePress(int button, int state, int x, int y){
 		default:
 		break;
 	}
-	glutPostRedisplay();
 
 }
 
 void mouseHover(int x, int y){
+	if (glRenderer->idPicker.b_enabled) glRenderer->idPicker.request(x, y);
 	if (selectedShape != NULL){
 		selectedShape->changeCursor(x,y);
 	}
 }
 
+// one wheel step zooms by 25%, animated
+void mouseWheel(int wheel, int direction, int x, int y){
+	glRenderer->camera.zoomAt(x, y, direction > 0? 1.25f : 0.8f);
+	glRenderer->markDirty();
+}
+
 void mouseMove(int x, int y){
-	float winh = glutGet(GLUT_WINDOW_HEIGHT);
-	float winw = glutGet(GLUT_WINDOW_WIDTH);
-	
 //	cout << "transform: " << mousetransform << endl;
 	
 	int cursorLoc = 0;
@@ -1102,38 +1537,42 @@ void mouseMove(int x, int y){
 	
 	if (lMousePressed == 1){
 		// get initial and final mouse position in world coordinates
-		float xndc = 2*x/winw-1;
-		float yndc = 1-2*y/winh;
-
-		float x0ndc = 2*mouse_x0/winw-1;
-		float y0ndc = 1-2*mouse_y0/winh;
-	
-		glm::vec3 p = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(xndc, yndc, 0.f, 1.f);
-		glm::vec3 p0 = glm::inverse(glRenderer->projection * glRenderer->view)*glm::vec4(x0ndc, y0ndc, 0.f, 1.f);
+		glm::vec2 p = glRenderer->camera.screenToWorld(x, y);
+		glm::vec2 p0 = glRenderer->camera.screenToWorld(mouse_x0, mouse_y0);
 		
-		// if any shape is selected, move the shape and the selection box
-		if (selectedShape != NULL ){
-			glm::vec3 dp = p-p0;
-
-			if (mousetransform == "t") selectedShape->move(p0.x, p0.y, p.x, p.y);
-			else if (mousetransform == "s") selectedShape->resize(p0.x, p0.y, p.x, p.y);
-			selectionBox->model = glm::translate(selectionBox->model, dp);
+		// if a frame is selected, move the frame and the selection box.
+		// The unsnapped rectangle follows the mouse, so that a snapped frame comes loose
+		// once the mouse has moved beyond the snap distance.
+		Frame * f = dynamic_cast<Frame*>(selectedShape);
+		if (f != NULL){
+			glm::vec2 dp = p-p0;
+
+			if (mousetransform == "t"){
+				dragRect += glm::vec4(dp, dp);
+				glm::vec4 r = glRenderer->guides.snapMove(f, dragRect);
+				f->move(f->x0, f->y0, r.x, r.y);
+			}
+			else if (mousetransform == "s"){
+				dragRect.z += dp.x; dragRect.w += dp.y;
+				glm::vec4 r = glRenderer->guides.snapResize(f, dragRect);
+				f->resize(f->x1, f->y1, r.z, r.w);
+			}
+			fitSelectionBox(f);
+			glRenderer->markDirty();
 		}
-//		glRenderer->camera_rx += 0.2*(y - mouse_y0);
-//		glRenderer->camera_ry += 0.2*(x - mouse_x0);
 	}
+	// dragging down zooms in, about the point where the button went down
 	if (rMousePressed == 1){
-//		float r = (y - mouse_y0)/h;
-//		glRenderer->camera_s *= 1+r;
+		float r = (y - mouse_y0)/glRenderer->camera.viewport[3];
+		glRenderer->camera.zoomAt(zoom_x0, zoom_y0, exp(2*r), false);
+		glRenderer->markDirty();
 	}
 	if (mMousePressed == 1){
-//		glRenderer->camera_ty -= (h/2.5)*(y - mouse_y0)/h;	// -= because y is measured from top
-//		glRenderer->camera_tx += (w/2.5)*(x - mouse_x0)/w;
+		glRenderer->camera.pan(x - mouse_x0, y - mouse_y0);
+		glRenderer->markDirty();
 	}
 	mouse_y0 = y;
 	mouse_x0 = x;
-	
-	glutPostRedisplay();
 
 }
 
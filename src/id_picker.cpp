@@ -0,0 +1,201 @@
+#include "../headers/graphics.h"
+#include "../headers/id_picker.h"
+
+#include <algorithm>
+#include <climits>
+using namespace std;
+
+// ===========================================================
+// class IdPicker
+// ===========================================================
+
+IdPicker::IdPicker(){
+	b_enabled = false;
+	radius = 3;
+	pbo = 0;
+	fence = 0;
+	requestFrame = resultFrame = -1;
+	b_waiting = b_tracking = b_result = false;
+	picked = NULL;
+}
+
+void IdPicker::init(){
+	glGenBuffers(1, &pbo);
+}
+
+void IdPicker::destroy(){
+	if (fence != 0) glDeleteSync(fence);
+	fence = 0;
+	glDeleteBuffers(1, &pbo);
+	if (fbo.fbo != 0) fbo.destroy();
+	for (map <string, ShaderProgram*>::iterator it = pickPrograms.begin(); it != pickPrograms.end(); ++it) releaseProgram(it->second);
+	pickPrograms.clear();
+}
+
+// by name and variant, as programs without users may be deleted and their address reused
+ShaderProgram * IdPicker::pickProgram(ShaderProgram * p){
+	string variant = (p->variant == "")? "PICK" : p->variant + " PICK";
+	string key = p->name + "|" + variant;
+	map <string, ShaderProgram*>::iterator it = pickPrograms.find(key);
+	if (it != pickPrograms.end()) return it->second;
+	ShaderProgram * q = acquireProgram(p->name, variant);
+	pickPrograms[key] = q;
+	return q;
+}
+
+
+void IdPicker::request(int x, int y){
+	b_tracking = true;
+	trackX = x; trackY = y;
+	poll();
+	if (fence != 0){
+		b_waiting = true;
+		waitingX = x; waitingY = y;
+		return;
+	}
+	renderIds(x, y);
+}
+
+void IdPicker::refresh(){
+	if (b_enabled && b_tracking) request(trackX, trackY);
+}
+
+void IdPicker::poll(){
+	if (fence == 0) return;
+	GLenum r = glClientWaitSync(fence, 0, 0);
+	if (r != GL_ALREADY_SIGNALED && r != GL_CONDITION_SATISFIED) return;
+	collect();
+	if (b_waiting){
+		b_waiting = false;
+		renderIds(waitingX, waitingY);
+	}
+}
+
+bool IdPicker::result(int x, int y, Shape * &s){
+	poll();
+	if (!b_result || x != resultX || y != resultY || resultFrame != glRenderer->residency.frameNumber) return false;
+	s = picked;
+	return true;
+}
+
+
+// Draws the pickable shapes in the order and with the depth test of the normal pass,
+// so that the id left at a pixel is that of the shape seen there.
+void IdPicker::renderIds(int x, int y){
+	Camera &cam = glRenderer->camera;
+	int w = cam.viewport[2], h = cam.viewport[3];
+	int fx = x - cam.viewport[0], fy = cam.windowHeight-1-y - cam.viewport[1];
+	requestX = x; requestY = y;
+	requestFrame = glRenderer->residency.frameNumber;
+
+	ids.clear();
+	if (fx < 0 || fy < 0 || fx >= w || fy >= h){	// outside the viewport: nothing to draw
+		b_result = true;
+		resultX = x; resultY = y;
+		resultFrame = requestFrame;
+		picked = NULL;
+		return;
+	}
+	if (fbo.width != w || fbo.height != h){
+		if (fbo.fbo != 0) fbo.destroy();
+		if (!fbo.create(w, h, GL_R32UI)){	// no ID target: fall back to the frameIndex for good
+			cout << "WARNING: GPU picking disabled, only frames can be picked\n";
+			b_enabled = false;
+			b_result = false;
+			return;
+		}
+	}
+	readX = max(fx-radius, 0); readW = min(fx+radius+1, w) - readX;
+	readY = max(fy-radius, 0); readH = min(fy+radius+1, h) - readY;
+	cursorX = fx; cursorY = fy;
+
+	GLint fb0, viewport0[4];
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &fb0);
+	glGetIntegerv(GL_VIEWPORT, viewport0);
+
+	fbo.bind();
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(readX, readY, readW, readH);
+	GLuint zero[4] = {0, 0, 0, 0};
+	glClearBufferuiv(GL_COLOR, 0, zero);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	glRenderer->updateCameraBuffer();	// the camera may have moved since the last frame
+	RenderState &state = glRenderer->state;
+	state.reset();
+	state.setBlend(false);
+
+	RenderQueue queue;
+	queue.build(glRenderer->shapes_vec);
+	FrameRenderer &fr = glRenderer->frameRenderer;
+	ShaderProgram * framePick = pickProgram(fr.program);
+	for (int i=0; i<queue.items.size(); ++i){
+		Shape * s = queue.items[i].shape;
+		if (!s->b_pickable || s->layer < 0) continue;	// backdrops are not picked, as in SpatialIndex::topmost
+		Frame * f = dynamic_cast<Frame*>(s);
+		if (f != NULL){
+			fr.submit(f);		// not the tiles of a virtual texture, the overview covers the frame
+			ids.push_back(f);
+			continue;
+		}
+		if (s->program == NULL) continue;
+		fr.flush(framePick, ids.size()+1 - fr.instances.size());
+		ids.push_back(s);
+		ShaderProgram * prog = pickProgram(s->program);
+		state.useProgram(prog->program_id);
+		glUniform1ui(prog->uniformLocation("pickId"), ids.size());
+		s->draw(prog);
+	}
+	fr.flush(framePick, ids.size()+1 - fr.instances.size());
+	state.bindVertexArray(0);
+	state.setBlend(true);
+	glDisable(GL_SCISSOR_TEST);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo.fbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, 4*readW*readH, NULL, GL_STREAM_READ);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(readX, readY, readW, readH, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();		// so that the fence signals without anyone waiting on it
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fb0);
+	glViewport(viewport0[0], viewport0[1], viewport0[2], viewport0[3]);
+}
+
+// the hit nearest to the cursor wins
+void IdPicker::collect(){
+	glDeleteSync(fence);
+	fence = 0;
+
+	GLuint id = 0;
+	int best = INT_MAX;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+	const GLuint * p = (const GLuint*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4*readW*readH, GL_MAP_READ_BIT);
+	if (p != NULL){
+		for (int j=0; j<readH; ++j){
+			for (int i=0; i<readW; ++i){
+				GLuint v = p[j*readW+i];
+				if (v == 0 || v > ids.size()) continue;
+				int dx = readX+i-cursorX, dy = readY+j-cursorY;
+				if (dx*dx + dy*dy < best){
+					best = dx*dx + dy*dy;
+					id = v;
+				}
+			}
+		}
+	}
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	// the shape may have been deleted while the readback was in flight
+	picked = (id == 0)? NULL : ids[id-1];
+	vector <Shape*> &shapes = glRenderer->shapes_vec;
+	if (picked != NULL && find(shapes.begin(), shapes.end(), picked) == shapes.end()) picked = NULL;
+
+	b_result = true;
+	resultX = requestX; resultY = requestY;
+	resultFrame = requestFrame;
+	ids.clear();
+}
@@ -0,0 +1,343 @@
+#include "../headers/image_io.h"
+#include "../headers/color_convert.h"
+
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <iostream>
+#include <algorithm>
+#include <jpeglib.h>
+#include <png.h>
+using namespace std;
+
+
+bool loadImage(string filename, vector <unsigned char> &pixels, int &width, int &height, int limit){
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL){
+		cout << "ERROR: Could not open image " << filename << "\n";
+		return false;
+	}
+	unsigned char magic[8] = {0};
+	size_t n = fread(magic, 1, 8, fp);
+	fclose(fp);
+	
+	if (n >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF) return loadJPEG(filename, pixels, width, height, limit);
+	if (n >= 8 && png_sig_cmp(magic, 0, 8) == 0) return loadPNG(filename, pixels, width, height);
+	if (n >= 2 && magic[0] == 'P' && (magic[1] == '6' || magic[1] == '7')) return loadPNM(filename, pixels, width, height);
+	
+	cout << "ERROR: Unknown image format: " << filename << "\n";
+	return false;
+}
+
+
+// ===========================================================
+// JPEG
+// ===========================================================
+
+// libjpeg calls error_exit on fatal errors, which by default exits the program.
+// Jump back to loadJPEG instead, so that a broken file only fails its own frame.
+struct JpegErrorMgr{
+	jpeg_error_mgr pub;
+	jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo){
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	cout << "ERROR: libjpeg: " << msg << "\n";
+	longjmp(((JpegErrorMgr*)cinfo->err)->jump, 1);
+}
+
+// YCbCr images are converted to RGBA by yccToRGBA (SIMD), others by libjpeg
+static void setJpegOutput(jpeg_decompress_struct &cinfo){
+	cinfo.out_color_space = (cinfo.jpeg_color_space == JCS_YCbCr)? JCS_YCbCr : JCS_RGB;	// JCS_RGB also converts greyscale
+}
+
+static void jpegRowToRGBA(jpeg_decompress_struct &cinfo, const unsigned char * row, unsigned char * d){
+	int width = cinfo.output_width;
+	if (cinfo.out_color_space == JCS_YCbCr){
+		yccToRGBA(row, width, d);
+		return;
+	}
+	for (int i=0; i<width; ++i){
+		d[4*i+0] = row[3*i+0];
+		d[4*i+1] = row[3*i+1];
+		d[4*i+2] = row[3*i+2];
+		d[4*i+3] = 255;
+	}
+}
+
+bool loadJPEG(string filename, vector <unsigned char> &pixels, int &width, int &height, int limit){
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+	
+	jpeg_decompress_struct cinfo;
+	JpegErrorMgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpegErrorExit;
+	vector <unsigned char> row;
+	vector <JSAMPROW> rows;
+	if (setjmp(jerr.jump)){
+		jpeg_destroy_decompress(&cinfo);
+		fclose(fp);
+		return false;
+	}
+	
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+	jpeg_read_header(&cinfo, TRUE);
+	setJpegOutput(cinfo);
+	
+	// the smallest DCT scaling which still covers limit: most of the decoding work is skipped
+	if (limit > 0){
+		int m = max(cinfo.image_width, cinfo.image_height), d = 8;
+		while (d > 1 && (m+d-1)/d < limit) d /= 2;
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = d;
+	}
+	jpeg_start_decompress(&cinfo);
+	
+	width = cinfo.output_width;
+	height = cinfo.output_height;
+	pixels.resize(size_t(width)*height*4);
+	
+	// a few rows at a time (as many as libjpeg produces per call), converted into place
+	int nRows = max(cinfo.rec_outbuf_height, 1);
+	row.resize(size_t(width)*3*nRows);
+	rows.resize(nRows);
+	for (int j=0; j<nRows; ++j) rows[j] = &row[size_t(j)*width*3];
+	while (cinfo.output_scanline < cinfo.output_height){
+		int y = cinfo.output_scanline;
+		int n = jpeg_read_scanlines(&cinfo, &rows[0], nRows);
+		for (int j=0; j<n; ++j) jpegRowToRGBA(cinfo, rows[j], &pixels[size_t(y+j)*width*4]);
+	}
+	
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(fp);
+	return true;
+}
+
+
+// ===========================================================
+// PNG
+// ===========================================================
+
+bool loadPNG(string filename, vector <unsigned char> &pixels, int &width, int &height){
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	
+	if (!png_image_begin_read_from_file(&image, filename.c_str())){
+		cout << "ERROR: libpng: " << image.message << "\n";
+		return false;
+	}
+	image.format = PNG_FORMAT_RGBA;
+	width = image.width;
+	height = image.height;
+	pixels.resize(PNG_IMAGE_SIZE(image));
+	
+	if (!png_image_finish_read(&image, NULL, &pixels[0], 0, NULL)){
+		cout << "ERROR: libpng: " << image.message << "\n";
+		png_image_free(&image);
+		return false;
+	}
+	return true;
+}
+
+
+// ===========================================================
+// PPM (P6) / PAM (P7)
+// ===========================================================
+
+// parse a P6/P7 header, leaving fp at the start of the raster
+static bool readPNMHeader(FILE * fp, int &width, int &height, int &channels){
+	char type = 0;
+	int maxval = 0;
+	bool ok = false;
+	channels = 0;
+	if (fscanf(fp, "P%c", &type) == 1 && type == '6'){
+		ok = (fscanf(fp, "%d %d %d", &width, &height, &maxval) == 3);
+		channels = 3;
+	}
+	else if (type == '7'){
+		char key[32];
+		width = height = 0;
+		while (fscanf(fp, "%31s", key) == 1 && strcmp(key, "ENDHDR") != 0){
+			if      (strcmp(key, "WIDTH")  == 0) ok = (fscanf(fp, "%d", &width) == 1);
+			else if (strcmp(key, "HEIGHT") == 0) ok = (fscanf(fp, "%d", &height) == 1);
+			else if (strcmp(key, "DEPTH")  == 0) ok = (fscanf(fp, "%d", &channels) == 1);
+			else if (strcmp(key, "MAXVAL") == 0) ok = (fscanf(fp, "%d", &maxval) == 1);
+			else { int c; while ((c = fgetc(fp)) != '\n' && c != EOF); }	// TUPLTYPE, comments
+		}
+	}
+	fgetc(fp);	// single whitespace before the raster
+	return ok && width > 0 && height > 0 && maxval == 255 && (channels == 3 || channels == 4);
+}
+
+static void pnmRowToRGBA(const unsigned char * src, int width, int channels, unsigned char * d){
+	for (int i=0; i<width; ++i){
+		d[4*i+0] = src[channels*i+0];
+		d[4*i+1] = src[channels*i+1];
+		d[4*i+2] = src[channels*i+2];
+		d[4*i+3] = (channels == 4)? src[4*i+3] : 255;
+	}
+}
+
+bool loadPNM(string filename, vector <unsigned char> &pixels, int &width, int &height){
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+	
+	int channels;
+	if (!readPNMHeader(fp, width, height, channels)){
+		cout << "ERROR: Unsupported PPM/PAM file: " << filename << "\n";
+		fclose(fp);
+		return false;
+	}
+	
+	pixels.resize(size_t(width)*height*4);
+	vector <unsigned char> row(size_t(width)*channels);
+	bool ok = true;
+	for (int j=0; j<height && ok; ++j){
+		ok = (fread(&row[0], 1, row.size(), fp) == row.size());
+		pnmRowToRGBA(&row[0], width, channels, &pixels[size_t(j)*width*4]);
+	}
+	fclose(fp);
+	return ok;
+}
+
+
+bool readImageSize(string filename, int &width, int &height){
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+	unsigned char magic[8] = {0};
+	size_t n = fread(magic, 1, 8, fp);
+	rewind(fp);
+	
+	bool ok = false;
+	if (n >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF){
+		jpeg_decompress_struct cinfo;
+		JpegErrorMgr jerr;
+		cinfo.err = jpeg_std_error(&jerr.pub);
+		jerr.pub.error_exit = jpegErrorExit;
+		if (setjmp(jerr.jump) == 0){
+			jpeg_create_decompress(&cinfo);
+			jpeg_stdio_src(&cinfo, fp);
+			jpeg_read_header(&cinfo, TRUE);
+			width = cinfo.image_width;
+			height = cinfo.image_height;
+			ok = true;
+		}
+		jpeg_destroy_decompress(&cinfo);
+	}
+	else if (n >= 8 && png_sig_cmp(magic, 0, 8) == 0){
+		png_image image;
+		memset(&image, 0, sizeof(image));
+		image.version = PNG_IMAGE_VERSION;
+		if (png_image_begin_read_from_stdio(&image, fp)){
+			width = image.width;
+			height = image.height;
+			ok = true;
+		}
+		png_image_free(&image);
+	}
+	else if (n >= 2 && magic[0] == 'P'){
+		int channels;
+		ok = readPNMHeader(fp, width, height, channels);
+	}
+	fclose(fp);
+	return ok;
+}
+
+
+// ===========================================================
+// class ImageReader
+// ===========================================================
+
+struct JpegReader{
+	jpeg_decompress_struct cinfo;
+	JpegErrorMgr jerr;
+};
+
+ImageReader::ImageReader(){
+	fp = NULL;
+	jpeg = NULL;
+	width = height = channels = y = 0;
+}
+
+ImageReader::~ImageReader(){
+	close();
+}
+
+bool ImageReader::open(string filename){
+	close();
+	unsigned char magic[8] = {0};
+	fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return false;
+	size_t n = fread(magic, 1, 8, fp);
+	rewind(fp);
+	y = 0;
+	
+	if (n >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF){
+		jpeg = new JpegReader;
+		jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr.pub);
+		jpeg->jerr.pub.error_exit = jpegErrorExit;
+		if (setjmp(jpeg->jerr.jump)){
+			close();
+			return false;
+		}
+		jpeg_create_decompress(&jpeg->cinfo);
+		jpeg_stdio_src(&jpeg->cinfo, fp);
+		jpeg_read_header(&jpeg->cinfo, TRUE);
+		setJpegOutput(jpeg->cinfo);
+		jpeg_start_decompress(&jpeg->cinfo);
+		width = jpeg->cinfo.output_width;
+		height = jpeg->cinfo.output_height;
+		row.resize(size_t(width)*3);
+		return true;
+	}
+	if (n >= 2 && magic[0] == 'P'){
+		if (!readPNMHeader(fp, width, height, channels)){
+			close();
+			return false;
+		}
+		row.resize(size_t(width)*channels);
+		return true;
+	}
+	
+	fclose(fp);
+	fp = NULL;
+	return loadImage(filename, pixels, width, height);
+}
+
+bool ImageReader::readRow(unsigned char * rgba){
+	if (y >= height) return false;
+	
+	if (jpeg != NULL){
+		if (setjmp(jpeg->jerr.jump)) return false;
+		JSAMPROW r = &row[0];
+		jpeg_read_scanlines(&jpeg->cinfo, &r, 1);
+		jpegRowToRGBA(jpeg->cinfo, &row[0], rgba);
+	}
+	else if (fp != NULL){
+		if (fread(&row[0], 1, row.size(), fp) != row.size()) return false;
+		pnmRowToRGBA(&row[0], width, channels, rgba);
+	}
+	else {
+		memcpy(rgba, &pixels[size_t(y)*width*4], size_t(width)*4);
+	}
+	++y;
+	return true;
+}
+
+void ImageReader::close(){
+	if (jpeg != NULL){
+		jpeg_destroy_decompress(&jpeg->cinfo);	// also aborts an unfinished decompression
+		delete jpeg;
+		jpeg = NULL;
+	}
+	if (fp != NULL) fclose(fp);
+	fp = NULL;
+	pixels.clear();
+	row.clear();
+}
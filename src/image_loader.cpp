@@ -0,0 +1,425 @@
+#include "../headers/graphics.h"
+#include "../headers/image_loader.h"
+#include "../headers/image_io.h"
+#include "../headers/mip_cache.h"
+#include "../headers/bc_encoder.h"
+#include "../headers/virtual_texture.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+// ===========================================================
+// class ImageLoader
+// ===========================================================
+
+ImageJob::ImageJob(Frame * f, string _filename, int _stage, int _limit){
+	frame = f;
+	filename = _filename;
+	stage = _stage;
+	limit = _limit;
+	priority = 0;
+	compress = false;
+	ok = hasAlpha = complete = false;
+	contentHash = 0;
+	width = height = W = H = 0;
+	format = GL_RGBA8;
+	data = NULL;
+	dataSize = 0;
+	map = NULL;
+	mapSize = 0;
+}
+
+ImageJob::~ImageJob(){
+	if (map != NULL) munmap(map, mapSize);
+}
+
+bool jobOrder(const ImageJob * a, const ImageJob * b){
+	if (a->stage != b->stage) return a->stage > b->stage;
+	return a->priority < b->priority;
+}
+
+ImageLoader::ImageLoader(){
+	pool = NULL;
+	placeholder = NULL;
+	cache = NULL;
+	nThreads = 0;
+	thumbSize = 256;
+	tileSize = 256;
+	b_compress = false;
+	uploadBudget = 64*1024*1024;
+	decodedLimit = 256*1024*1024;
+	decodedBytes = 0;
+	pbo[0] = pbo[1] = 0;
+	nextPbo = 0;
+	wakePipe[0] = wakePipe[1] = -1;
+	b_quit = false;
+}
+
+void ImageLoader::init(TexturePool * _pool, MipCache * _cache, int _nThreads){
+	pool = _pool;
+	cache = _cache;
+	
+	unsigned char grey[] = {
+	  200,200,200,255, 	200,200,200,255, 
+	  200,200,200,255,  200,200,200,255, 
+	};
+	placeholder = pool->acquire(grey, 2, 2);
+	
+	glGenBuffers(2, pbo);
+	nextPbo = 0;
+	
+	if (pipe(wakePipe) == 0){
+		fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+	}
+	else cout << "ERROR: Could not create the image loader's wake-up pipe\n";
+	
+	nThreads = _nThreads;
+	if (nThreads <= 0) nThreads = max(int(thread::hardware_concurrency())-1, 1);
+	b_quit = false;
+	for (int i=0; i<nThreads; ++i) workers.push_back(thread(&ImageLoader::workerLoop, this));
+}
+
+void ImageLoader::destroy(){
+	if (pool == NULL) return;
+	{
+		lock_guard <mutex> lock(mtx);
+		b_quit = true;
+	}
+	cond.notify_all();
+	for (int i=0; i<workers.size(); ++i) workers[i].join();
+	workers.clear();
+	
+	for (int i=0; i<pending.size(); ++i) delete pending[i];
+	for (int i=0; i<decoded.size(); ++i) delete decoded[i];
+	pending.clear();
+	decoded.clear();
+	decodedBytes = 0;
+	
+	glDeleteBuffers(2, pbo);
+	close(wakePipe[0]);
+	close(wakePipe[1]);
+	pool->release(placeholder);
+	placeholder = NULL;
+	pool = NULL;
+}
+
+
+void ImageLoader::request(Frame * f, string filename, int stage, int limit){
+	f->b_loading = true;
+	if (stage == ThumbStage || limit <= 0) limit = thumbSize;
+	ImageJob * job = new ImageJob(f, filename, stage, min(limit, pool->maxSize));
+	job->priority = f->screenArea();
+	job->compress = b_compress;
+	{
+		lock_guard <mutex> lock(mtx);
+		enqueue(job);
+	}
+	cond.notify_one();
+}
+
+void ImageLoader::enqueue(ImageJob * job){
+	pending.push_back(job);
+	push_heap(pending.begin(), pending.end(), jobOrder);
+}
+
+// the view may have changed since the jobs were queued
+void ImageLoader::updatePriorities(){
+	lock_guard <mutex> lock(mtx);
+	if (pending.empty()) return;
+	for (int i=0; i<pending.size(); ++i) pending[i]->priority = pending[i]->frame->screenArea();
+	make_heap(pending.begin(), pending.end(), jobOrder);
+}
+
+void ImageLoader::cancel(Frame * f){
+	lock_guard <mutex> lock(mtx);
+	for (int i=0; i<pending.size(); ){
+		if (pending[i]->frame == f){ delete pending[i]; pending.erase(pending.begin()+i); }
+		else ++i;
+	}
+	make_heap(pending.begin(), pending.end(), jobOrder);
+	bool freed = false;
+	for (int i=0; i<decoded.size(); ){
+		if (decoded[i]->frame == f){
+			decodedBytes -= decoded[i]->dataSize;
+			freed = true;
+			delete decoded[i];
+			decoded.erase(decoded.begin()+i);
+		}
+		else ++i;
+	}
+	if (freed) cond.notify_all();
+	// jobs being decoded are dropped by their worker once it is done
+	for (int i=0; i<running.size(); ++i) if (running[i]->frame == f) running[i]->frame = NULL;
+}
+
+int ImageLoader::nOutstanding(){
+	lock_guard <mutex> lock(mtx);
+	return pending.size() + running.size() + decoded.size();
+}
+
+int ImageLoader::wakeFd(){
+	return wakePipe[0];
+}
+
+
+void ImageLoader::workerLoop(){
+	while (1){
+		ImageJob * job;
+		{
+			unique_lock <mutex> lock(mtx);
+			while (!b_quit && (pending.empty() || decodedBytes >= decodedLimit)) cond.wait(lock);
+			if (b_quit) return;
+			pop_heap(pending.begin(), pending.end(), jobOrder);
+			job = pending.back();
+			pending.pop_back();
+			running.push_back(job);
+		}
+		
+		decode(job);
+		
+		{
+			lock_guard <mutex> lock(mtx);
+			running.erase(find(running.begin(), running.end(), job));
+			if (job->frame == NULL) delete job;		// cancelled while decoding
+			else {
+				decoded.push_back(job);
+				decodedBytes += job->dataSize;
+			}
+		}
+		decodedCond.notify_all();
+		char c = 1;
+		if (write(wakePipe[1], &c, 1) < 0){}	// pipe full: the GL thread has been woken up already
+	}
+}
+
+// Hash of the encoded file: images are decoded at different scales for 
+// different levels of detail, the file is the same for all of them. It is
+// remembered per file version, so that the thumbnail and every level of 
+// detail decoded later read the file for it once.
+unsigned long long ImageLoader::fileHash(const string &filename){
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0) return 0;
+	{
+		lock_guard <mutex> lock(hashMtx);
+		map <string, FileHash>::iterator it = fileHashes.find(filename);
+		if (it != fileHashes.end() && it->second.size == st.st_size && it->second.mtime == modificationTime(st)) return it->second.hash;
+	}
+	
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL) return 0;
+	vector <unsigned char> buf(1 << 20);	// a multiple of 8, so that chunks hash like the whole file
+	unsigned long long h = hashBytes(NULL, 0);
+	size_t n;
+	while ((n = fread(&buf[0], 1, buf.size(), fp)) > 0) h = hashBytes(&buf[0], n, h);
+	fclose(fp);
+	
+	FileHash fh = {(long long)st.st_size, modificationTime(st), (h == 0)? 1 : h};
+	lock_guard <mutex> lock(hashMtx);
+	fileHashes[filename] = fh;
+	return fh.hash;
+}
+
+// runs on a worker thread: no GL calls here
+void ImageLoader::decode(ImageJob * job){
+	int limit = job->limit;
+	bool compress = job->compress;
+	
+	// images larger than the pool keep their full detail in a tile store, the pool gets its overview
+	int srcWidth = 0, srcHeight = 0;
+	readImageSize(job->filename, srcWidth, srcHeight);
+	if (cache != NULL && max(srcWidth, srcHeight) > pool->maxSize){
+		job->tileStore = cache->tileStorePath(job->filename);
+	}
+	bool haveStore = job->tileStore.empty() || access(job->tileStore.c_str(), R_OK) == 0;
+	if (cache != NULL && haveStore && cache->lookup(job, limit, pool, compress)) return;
+	
+	vector <unsigned char> pixels;
+	int width, height;
+	if (!job->tileStore.empty()){
+		job->ok = VirtualTexture::prepare(job->filename, job->tileStore, tileSize, pool->maxSize, pixels, width, height);
+		if (job->ok && !haveStore) cache->add(job->tileStore);	// built just now
+	}
+	if (!job->ok){
+		job->tileStore = "";
+		job->ok = loadImage(job->filename, pixels, width, height, limit);	// JPEGs decode at about the size needed
+	}
+	if (!job->ok) return;
+	
+	job->hasAlpha = imageHasAlpha(&pixels[0], width, height);
+	job->contentHash = fileHash(job->filename);
+	pool->sizeClass(width, height, job->width, job->height, job->W, job->H, limit);
+	job->complete = (job->width == srcWidth && job->height == srcHeight);
+	buildMipChain(&pixels[0], width, height, job->width, job->height, job->W, job->H, job->levels, job->offsets);
+	if (compress) compressMipChain(job);
+	job->data = &job->levels[0];
+	job->dataSize = job->levels.size();
+	
+	if (cache != NULL) cache->store(job, limit, compress);
+}
+
+// replace the RGBA levels of job with BC1 (opaque) or BC3 (with alpha) levels
+void ImageLoader::compressMipChain(ImageJob * job){
+	job->format = job->hasAlpha? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	
+	int n = job->offsets.size();
+	vector <size_t> offsets(n);
+	size_t total = 0;
+	for (int l=0; l<n; ++l){
+		offsets[l] = total;
+		total += levelBytes(job->format, max(job->W>>l,1), max(job->H>>l,1));
+	}
+	
+	vector <unsigned char> blocks(total);
+	for (int l=0; l<n; ++l){
+		int lw = max(job->W>>l,1), lh = max(job->H>>l,1);
+		if (job->hasAlpha) compressBC3(&job->levels[job->offsets[l]], lw, lh, &blocks[offsets[l]]);
+		else               compressBC1(&job->levels[job->offsets[l]], lw, lh, &blocks[offsets[l]]);
+	}
+	job->levels.swap(blocks);
+	job->offsets.swap(offsets);
+}
+
+bool ImageLoader::enableCompression(bool on){
+	if (on && !GLEW_EXT_texture_compression_s3tc){
+		cout << "WARNING: S3TC texture compression is not supported, frame images stay uncompressed\n";
+		on = false;
+	}
+	b_compress = on;
+	return on;
+}
+
+// Copy data into a pixel unpack buffer and leave that bound, so that the driver transfers it 
+// to the texture asynchronously. Returns the pointer to pass to glTex(Sub)Image: an offset 
+// into the buffer, or data itself if the buffer could not be mapped. Unbind after the upload.
+const unsigned char * ImageLoader::stageUpload(const unsigned char * data, size_t bytes){
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[nextPbo]);
+	nextPbo = 1-nextPbo;
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);	// orphan the previous contents, the driver may still be reading them
+	void * dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (dst == NULL){
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return data;
+	}
+	memcpy(dst, data, bytes);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	return (const unsigned char*)0;
+}
+
+// GL thread: upload the mip chain through a pixel unpack buffer
+void ImageLoader::upload(ImageJob * job){
+	// the same photo may be resident already, for another frame
+	TextureSlot * slot = pool->findShared(job->contentHash, job->width, job->height, job->format);
+	if (slot == NULL){
+		// a replacement image of the same size class goes into the frame's own layer
+		TextureSlot * own = job->frame->slot;
+		if (own->refCount == 1 && own->page->width == job->W && own->page->height == job->H && own->page->format == job->format){
+			slot = own;
+			pool->retain(slot);
+		}
+		else slot = pool->allocate(job->W, job->H, job->format);
+		
+		const unsigned char * src = stageUpload(job->data, job->dataSize);
+		pool->uploadLevels(slot, job->width, job->height, src, job->offsets);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		pool->share(slot, job->contentHash);
+	}
+	
+	Frame * f = job->frame;
+	f->setImage(slot, job->hasAlpha);
+	f->residency = (job->stage == LodStage || job->complete)? FullRes : Thumbnail;
+	f->residentLimit = job->complete? pool->maxSize : job->limit;
+	pool->release(slot);	// the frame holds the slot now
+	
+	if (f->vt != NULL && f->vt->store != job->tileStore){
+		delete f->vt;
+		f->vt = NULL;
+	}
+	if (f->vt == NULL && !job->tileStore.empty()){
+		f->vt = new VirtualTexture;
+		if (!f->vt->open(job->tileStore)){
+			cout << "WARNING: Could not open the tile store of " << job->filename << "\n";
+			delete f->vt;
+			f->vt = NULL;
+		}
+	}
+	
+	// after the thumbnail, queue the level of detail needed on screen
+	int need = f->requiredLimit();
+	f->b_loading = (job->stage == ThumbStage && need > f->residentLimit);
+	if (f->b_loading){
+		ImageJob * next = new ImageJob(f, job->filename, LodStage, need);
+		next->priority = f->screenArea();
+		next->compress = b_compress;
+		{
+			lock_guard <mutex> lock(mtx);
+			enqueue(next);
+		}
+		cond.notify_one();
+	}
+}
+
+
+bool ImageLoader::pump(){
+	if (pool == NULL) return false;
+	
+	char buf[64];
+	while (read(wakePipe[0], buf, sizeof(buf)) > 0);
+	updatePriorities();
+	
+	bool changed = false;
+	size_t uploaded = 0;
+	while (uploaded < uploadBudget){
+		ImageJob * job;
+		{
+			lock_guard <mutex> lock(mtx);
+			if (decoded.empty()) break;
+			job = decoded.front();
+			decoded.pop_front();
+			decodedBytes -= job->dataSize;
+		}
+		cond.notify_all();		// workers paused at decodedLimit may go on
+		if (job->frame != NULL && job->ok){
+			// detail for a frame that is off screen: only if it fits the GPU budget, 
+			// otherwise it is requested again when the frame becomes visible
+			if (job->stage == LodStage && job->frame->screenArea() <= 0 && !glRenderer->residency.fits(job->dataSize)){
+				job->frame->b_loading = false;
+			}
+			else {
+				upload(job);
+				uploaded += job->dataSize;
+				changed = true;
+			}
+		}
+		else if (!job->ok){
+			cout << "WARNING: Frame keeps its placeholder: " << job->filename << "\n";
+			if (job->frame != NULL){
+				job->frame->b_loading = false;
+				job->frame->b_loadFailed = true;
+			}
+		}
+		delete job;
+	}
+	
+	// more images are waiting: come back on the next iteration of the event loop
+	if (uploaded >= uploadBudget){
+		char c = 1;
+		if (write(wakePipe[1], &c, 1) < 0){}
+	}
+	return changed;
+}
+
+void ImageLoader::finish(){
+	while (nOutstanding() > 0){
+		{
+			unique_lock <mutex> lock(mtx);
+			while (decoded.empty() && (!pending.empty() || !running.empty())) decodedCond.wait(lock);
+		}
+		pump();
+	}
+}
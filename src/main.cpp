@@ -55,10 +55,7 @@ int main(int argc, char ** argv){
 	f2.setLayer(1);
 //	f2.resize(25,25,50,50);
 	
-	while(1){       // infinite loop needed to poll anim_on signal.
-		glutMainLoopEvent();
-		usleep(20000);
-	}
+	hyperGL_mainLoop();		// blocks on input, redraws only when the scene changes
 	// launch sim end.
 	
 	return 0;
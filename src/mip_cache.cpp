@@ -0,0 +1,283 @@
+#include "../headers/mip_cache.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+using namespace std;
+
+static const int MIP_CACHE_VERSION = 5;
+
+long long modificationTime(const struct stat &st){
+	return st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// canonical absolute path, so that the same file gets the same entry from any working directory
+static string absolutePath(const string &filename){
+	char buf[PATH_MAX];
+	if (realpath(filename.c_str(), buf) == NULL) return filename;
+	return string(buf);
+}
+
+
+// ===========================================================
+// class MipCache
+// ===========================================================
+
+MipCache::MipCache(){
+	b_enabled = false;
+	maxBytes = size_t(4)*1024*1024*1024;
+	bytes = 0;
+}
+
+bool MipCache::init(string _dir){
+	dir = _dir;
+	if (dir.empty()){
+		const char * xdg = getenv("XDG_CACHE_HOME");
+		const char * home = getenv("HOME");
+		if (xdg != NULL && xdg[0] != '\0') dir = string(xdg) + "/album_designer";
+		else if (home != NULL)             dir = string(home) + "/.cache/album_designer";
+		else return (b_enabled = false);
+	}
+	
+	// create the directory and its parents
+	for (size_t i=1; i<=dir.size(); ++i){
+		if (i == dir.size() || dir[i] == '/') mkdir(dir.substr(0,i).c_str(), 0755);
+	}
+	struct stat st;
+	b_enabled = (stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && access(dir.c_str(), W_OK) == 0);
+	if (!b_enabled) cout << "WARNING: Mip cache disabled, cannot write to " << dir << "\n";
+	if (b_enabled){
+		lock_guard <mutex> lock(mtx);
+		bytes = scan();
+		if (bytes > maxBytes) trim(maxBytes/4*3);
+	}
+	return b_enabled;
+}
+
+
+// size limit: the files used longest ago go first
+
+struct CacheFile{
+	string path;
+	size_t size;
+	long long used;		// mtime, set on every hit
+};
+
+static bool usedEarlier(const CacheFile &a, const CacheFile &b){
+	return a.used < b.used;
+}
+
+static bool isCacheFile(const string &name){
+	if (name.find(".tmp.") != string::npos) return false;	// being written
+	return (name.size() > 4 && name.compare(name.size()-4, 4, ".mip") == 0)
+	    || (name.size() > 6 && name.compare(name.size()-6, 6, ".tiles") == 0);
+}
+
+static void listCacheFiles(const string &dir, vector <CacheFile> &files){
+	DIR * d = opendir(dir.c_str());
+	if (d == NULL) return;
+	struct dirent * e;
+	while ((e = readdir(d)) != NULL){
+		if (!isCacheFile(e->d_name)) continue;
+		CacheFile f;
+		f.path = dir + "/" + e->d_name;
+		struct stat st;
+		if (stat(f.path.c_str(), &st) != 0) continue;
+		f.size = st.st_size;
+		f.used = modificationTime(st);
+		files.push_back(f);
+	}
+	closedir(d);
+}
+
+size_t MipCache::scan(){
+	vector <CacheFile> files;
+	listCacheFiles(dir, files);
+	size_t b = 0;
+	for (int i=0; i<files.size(); ++i) b += files[i].size;
+	return b;
+}
+
+void MipCache::add(const string &file){
+	struct stat st;
+	if (!b_enabled || stat(file.c_str(), &st) != 0) return;
+	lock_guard <mutex> lock(mtx);
+	bytes += st.st_size;
+	if (bytes > maxBytes) trim(maxBytes/4*3);
+}
+
+// mtx must be held. Files mapped by a frame stay readable after the unlink.
+void MipCache::trim(size_t target){
+	vector <CacheFile> files;
+	listCacheFiles(dir, files);
+	sort(files.begin(), files.end(), usedEarlier);
+	bytes = 0;
+	for (int i=0; i<files.size(); ++i) bytes += files[i].size;
+	for (int i=0; i<files.size() && bytes > target; ++i){
+		if (unlink(files[i].path.c_str()) == 0) bytes -= files[i].size;
+	}
+}
+
+
+string MipCache::entryPath(const string &path, long long size, long long mtime, int limit, bool compressed){
+	unsigned long long h = hashBytes(path.data(), path.size());
+	h = hashBytes(&size, sizeof(size), h);
+	h = hashBytes(&mtime, sizeof(mtime), h);
+	h = hashBytes(&limit, sizeof(limit), h);
+	h = hashBytes(&compressed, sizeof(compressed), h);
+	char name[32];
+	sprintf(name, "/%016llx.mip", h);
+	return dir + name;
+}
+
+
+// one tile store per source file and version, see VirtualTexture
+string MipCache::tileStorePath(const string &filename){
+	if (!b_enabled) return "";
+	string path = absolutePath(filename);
+	struct stat src;
+	if (stat(path.c_str(), &src) != 0) return "";
+	long long size = src.st_size, mtime = modificationTime(src);
+	unsigned long long h = hashBytes(path.data(), path.size());
+	h = hashBytes(&size, sizeof(size), h);
+	h = hashBytes(&mtime, sizeof(mtime), h);
+	char name[32];
+	sprintf(name, "/%016llx.tiles", h);
+	utimensat(AT_FDCWD, (dir + name).c_str(), NULL, 0);	// used now, if it exists
+	return dir + name;
+}
+
+
+bool MipCache::lookup(ImageJob * job, int limit, const TexturePool * pool, bool compressed){
+	if (!b_enabled) return false;
+	
+	string path = absolutePath(job->filename);
+	struct stat src;
+	if (stat(path.c_str(), &src) != 0) return false;
+	
+	for (int L = limit; L <= pool->maxSize; L *= 2){
+		if (mapEntry(job, path, src, limit, pool, compressed, L)) return true;
+	}
+	return false;
+}
+
+
+// Map the entry built for entryLimit, and point job at its levels from the first one 
+// that fits limit
+bool MipCache::mapEntry(ImageJob * job, const string &path, struct stat &src, int limit, const TexturePool * pool, bool compressed, int entryLimit){
+	int fd = open(entryPath(path, src.st_size, modificationTime(src), entryLimit, compressed).c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	fstat(fd, &st);
+	futimens(fd, NULL);		// used now, see trim()
+	void * map = (st.st_size >= sizeof(MipCacheHeader))? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED) return false;
+	
+	// check that the entry really belongs to this file (hash collisions, stale or foreign files)
+	const MipCacheHeader * hd = (const MipCacheHeader*)map;
+	size_t dataOffset = sizeof(MipCacheHeader) + hd->pathLength;
+	bool valid = (memcmp(hd->magic, "MIPC", 4) == 0 && hd->version == MIP_CACHE_VERSION
+	              && hd->srcSize == src.st_size && hd->srcMtime == modificationTime(src) && hd->limit == entryLimit
+	              && hd->nLevels == mipLevels(hd->W, hd->H) && hd->pathLength == path.size()
+	              && isCompressedFormat(hd->format) == compressed
+	              && dataOffset <= st.st_size
+	              && memcmp((const char*)map + sizeof(MipCacheHeader), path.data(), path.size()) == 0);
+	
+	vector <size_t> offsets;
+	size_t bytes = 0;
+	if (valid){
+		offsets.resize(hd->nLevels);
+		for (int l=0; l<hd->nLevels; ++l){
+			offsets[l] = bytes;
+			bytes += levelBytes(hd->format, max(hd->W>>l,1), max(hd->H>>l,1));
+		}
+		valid = (dataOffset + bytes == st.st_size);
+	}
+	
+	// first level whose image fits the limit; it must be padded to the image's size class,
+	// as the pool's pages only come in these sizes (e.g. 3072 >> 4 = 192 is none)
+	int k = 0;
+	if (valid){
+		while (max(max(hd->width>>k,1), max(hd->height>>k,1)) > limit) ++k;
+		valid = (k < hd->nLevels && hd->W>>k == pool->classSize(max(hd->width>>k,1)) && hd->H>>k == pool->classSize(max(hd->height>>k,1)));
+	}
+	if (!valid){
+		munmap(map, st.st_size);
+		return false;
+	}
+	
+	job->ok = true;
+	job->width = max(hd->width>>k, 1); job->height = max(hd->height>>k, 1);
+	job->W = hd->W>>k; job->H = hd->H>>k;
+	job->format = hd->format;
+	job->hasAlpha = hd->hasAlpha;
+	job->contentHash = hd->contentHash;
+	job->complete = hd->complete && k == 0;
+	job->offsets.assign(offsets.begin()+k, offsets.end());
+	for (int l=0; l<job->offsets.size(); ++l) job->offsets[l] -= offsets[k];
+	job->map = map;
+	job->mapSize = st.st_size;
+	job->data = (const unsigned char*)map + dataOffset + offsets[k];
+	job->dataSize = bytes - offsets[k];
+	
+	// fault the pages in here, so that the GL thread's copy into the upload buffer never waits for the disk
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t first = (job->data - (const unsigned char*)map)/page*page;
+	madvise((char*)map + first, st.st_size - first, MADV_WILLNEED);
+	volatile unsigned char sum = 0;
+	for (size_t i=0; i<job->dataSize; i += 4096) sum += job->data[i];
+	return true;
+}
+
+
+void MipCache::store(ImageJob * job, int limit, bool compressed){
+	if (!b_enabled || !job->ok) return;
+	
+	string path = absolutePath(job->filename);
+	struct stat src;
+	if (stat(path.c_str(), &src) != 0) return;
+	
+	MipCacheHeader hd;
+	memset(&hd, 0, sizeof(hd));
+	memcpy(hd.magic, "MIPC", 4);
+	hd.version = MIP_CACHE_VERSION;
+	hd.srcSize = src.st_size;
+	hd.srcMtime = modificationTime(src);
+	hd.limit = limit;
+	hd.width = job->width; hd.height = job->height;
+	hd.W = job->W; hd.H = job->H;
+	hd.nLevels = job->offsets.size();
+	hd.format = job->format;
+	hd.hasAlpha = job->hasAlpha;
+	hd.complete = job->complete;
+	hd.contentHash = job->contentHash;
+	hd.pathLength = path.size();
+	
+	string entry = entryPath(path, src.st_size, modificationTime(src), limit, compressed);
+	stringstream tmp;
+	tmp << entry << ".tmp." << getpid() << "." << this_thread::get_id();
+	
+	FILE * fp = fopen(tmp.str().c_str(), "wb");
+	if (fp == NULL) return;
+	bool ok = (fwrite(&hd, sizeof(hd), 1, fp) == 1)
+	       && (fwrite(path.data(), 1, path.size(), fp) == path.size())
+	       && (fwrite(job->data, 1, job->dataSize, fp) == job->dataSize);
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmp.str().c_str(), entry.c_str()) != 0){
+		cout << "WARNING: Could not write mip cache entry for " << job->filename << "\n";
+		unlink(tmp.str().c_str());
+		return;
+	}
+	add(entry);
+}
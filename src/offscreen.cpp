@@ -0,0 +1,210 @@
+#include "../headers/graphics.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+using namespace std;
+
+// ===========================================================
+// class Framebuffer
+// ===========================================================
+
+Framebuffer::Framebuffer(){
+	fbo = color_rbo = depth_rbo = 0;
+	width = height = 0;
+	colorFormat = GL_RGBA8;
+}
+
+bool Framebuffer::create(int w, int h, GLenum format){
+	width = w; height = h;
+	colorFormat = format;
+	
+	glGenRenderbuffers(1, &color_rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, color_rbo);
+	glRenderbufferStorage(GL_RENDERBUFFER, colorFormat, width, height);
+	
+	glGenRenderbuffers(1, &depth_rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_rbo);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_rbo);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	
+	if (status != GL_FRAMEBUFFER_COMPLETE){
+		cout << "ERROR: Framebuffer " << width << "x" << height << " is incomplete (status " << status << ")\n";
+		destroy();		// leave no half made framebuffer for callers to reuse
+		return false;
+	}
+	return true;
+}
+
+void Framebuffer::destroy(){
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(1, &color_rbo);
+	glDeleteRenderbuffers(1, &depth_rbo);
+	fbo = color_rbo = depth_rbo = 0;
+	width = height = 0;
+}
+
+void Framebuffer::bind(){
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, width, height);
+}
+
+void Framebuffer::unbind(){
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void Framebuffer::readPixels(unsigned char * rgba){
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+	
+	// GL returns the bottom row first
+	size_t pitch = 4*size_t(width);
+	vector <unsigned char> row(pitch);
+	for (int j=0; j<height/2; ++j){
+		unsigned char * a = rgba + j*pitch, * b = rgba + (height-1-j)*pitch;
+		memcpy(&row[0], a, pitch);
+		memcpy(a, b, pitch);
+		memcpy(b, &row[0], pitch);
+	}
+}
+
+
+// ===========================================================
+// headless initialization
+// ===========================================================
+
+// the EGL objects of the headless context, released by cleanup_hyperGL_headless()
+static EGLDisplay eglDpy = EGL_NO_DISPLAY;
+static EGLContext eglCtx = EGL_NO_CONTEXT;
+static EGLSurface eglSurf = EGL_NO_SURFACE;
+
+// Create an OpenGL context through EGL without any window system (Mesa's surfaceless
+// platform, e.g. with llvmpipe on CPU-only machines), and render into a width x height
+// framebuffer object. The rest of the Renderer/Shape/Frame stack is unchanged; 
+// use Renderer::renderOffscreen() to draw and read back the image.
+bool init_hyperGL_headless(int width, int height){
+	cout << "init GL (headless)" << endl;
+	
+	glRenderer = new Renderer;
+	glRenderer->init();
+	glRenderer->b_headless = true;
+	glRenderer->window_width = width;
+	glRenderer->window_height = height;
+	glRenderer->viewport_aspect_ratio = float(width)/height;
+	glRenderer->camera.setViewport(0, 0, width, height, width, height);
+
+	// prefer the surfaceless platform, fall back to the default display
+	EGLDisplay dpy = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay != NULL) dpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (dpy == EGL_NO_DISPLAY) dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	
+	EGLint major, minor;
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, &major, &minor)){
+		cout << "ERROR: Could not initialize EGL\n";
+		return false;
+	}
+	eglDpy = dpy;
+	eglBindAPI(EGL_OPENGL_API);
+	
+	// colour and depth come from the framebuffer object, the config only needs to support GL
+	EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint nConfigs = 0;
+	eglChooseConfig(dpy, configAttribs, &config, 1, &nConfigs);
+	if (nConfigs < 1){
+		cout << "ERROR: No suitable EGL config\n";
+		cleanup_hyperGL_headless();
+		return false;
+	}
+	
+	// the shaders are #version 330: ask for a 3.3 core context (the driver may give a later
+	// version), else take the driver's default context and check its version below
+	EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+		EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+		EGL_NONE
+	};
+	EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+	if (ctx == EGL_NO_CONTEXT){
+		cout << "WARNING: No OpenGL 3.3 core context, falling back to the default context\n";
+		ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
+	}
+	if (ctx == EGL_NO_CONTEXT){
+		cout << "ERROR: Could not create EGL context\n";
+		cleanup_hyperGL_headless();
+		return false;
+	}
+	eglCtx = ctx;
+	
+	// we never draw to the EGL surface, so go surfaceless if possible, else use a dummy pbuffer
+	bool current = false;
+	const char * ext = eglQueryString(dpy, EGL_EXTENSIONS);
+	if (ext != NULL && strstr(ext, "EGL_KHR_surfaceless_context")) 
+		current = eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
+	if (!current){
+		EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+		eglSurf = eglCreatePbufferSurface(dpy, config, pbufferAttribs);
+		current = (eglSurf != EGL_NO_SURFACE) && eglMakeCurrent(dpy, eglSurf, eglSurf, ctx);
+	}
+	if (!current){
+		cout << "ERROR: Could not make the EGL context current\n";
+		cleanup_hyperGL_headless();
+		return false;
+	}
+	
+	// GLEW must be built with EGL support to load entry points in an EGL context
+	glewExperimental = GL_TRUE;
+	if (glewInit() != GLEW_OK) cout << "WARNING: glewInit failed, GLEW may lack EGL support\n";
+	glGetError();	// glewInit can leave a harmless error behind
+	
+	cout << "GL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << endl;
+	GLint glMajor = 0, glMinor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &glMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &glMinor);
+	if (glMajor < 3 || (glMajor == 3 && glMinor < 3)){
+		cout << "ERROR: OpenGL 3.3 or later is needed\n";
+		cleanup_hyperGL_headless();
+		return false;
+	}
+	
+	initGLState();
+	
+	glRenderer->offscreen = new Framebuffer;
+	if (!glRenderer->offscreen->create(width, height)){
+		delete glRenderer->offscreen;
+		glRenderer->offscreen = NULL;
+		cleanup_hyperGL_headless();
+		return false;
+	}
+	glRenderer->offscreen->bind();
+	
+	return true;
+}
+
+// Release the headless context, its dummy surface and the display. Safe to call 
+// after a failed or partial init_hyperGL_headless(), and more than once.
+void cleanup_hyperGL_headless(){
+	if (eglDpy == EGL_NO_DISPLAY) return;
+	eglMakeCurrent(eglDpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (eglSurf != EGL_NO_SURFACE) eglDestroySurface(eglDpy, eglSurf);
+	if (eglCtx != EGL_NO_CONTEXT) eglDestroyContext(eglDpy, eglCtx);
+	eglTerminate(eglDpy);
+	eglDpy = EGL_NO_DISPLAY;
+	eglCtx = EGL_NO_CONTEXT;
+	eglSurf = EGL_NO_SURFACE;
+}
+
@@ -0,0 +1,309 @@
+#include "../headers/graphics.h"
+#include "../headers/page_layout.h"
+#include "../headers/image_io.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+using namespace std;
+
+// part of a photo of aspect a cut away to fill a cell of aspect c
+static float cropLoss(float a, float c){
+	return 1 - min(a/c, c/a);
+}
+
+// centred crop of a photo of aspect a to a cell of aspect c
+static glm::vec4 cropRect(float a, float c){
+	if (a > c) return glm::vec4((1-c/a)/2, 0.f, c/a, 1.f);
+	else return glm::vec4(0.f, (1-a/c)/2, 1.f, a/c);
+}
+
+static float aspectOfRect(glm::vec4 r){
+	return (r.z-r.x)/(r.w-r.y);
+}
+
+// Aspect of photos a[0..n) sliced into a tree of balanced cuts without cropping, choosing
+// at each node the cut whose result comes closest to the target aspect. Photos side by
+// side add their aspects, photos one above the other the inverses. Spacing is left out.
+static float sliceAspect(const float * a, int n, float target, int &cut, bool &stacked){
+	if (n == 1) return a[0];
+	float best = -1;
+	for (int m = max(n/2-1, 1); m <= min(n/2+1, n-1); ++m){
+		for (int d=0; d<2; ++d){
+			int c; bool s;
+			float c1 = sliceAspect(a, m, (d == 0)? target*m/n : target*n/m, c, s);
+			float c2 = sliceAspect(a+m, n-m, (d == 0)? target*(n-m)/n : target*n/(n-m), c, s);
+			float r = (d == 0)? c1+c2 : 1/(1/c1 + 1/c2);
+			if (best < 0 || fabs(log(r/target)) < fabs(log(best/target))){
+				best = r;
+				cut = m;
+				stacked = (d == 1);
+			}
+		}
+	}
+	return best;
+}
+
+// cuts r as sliceAspect() does for its aspect, the first photos left or on top
+static void placeSlices(const float * a, int n, glm::vec4 r, float spacing, vector <glm::vec4> &out){
+	if (n == 1){
+		out.push_back(r);
+		return;
+	}
+	int m, c; bool stacked, s;
+	float target = aspectOfRect(r);
+	sliceAspect(a, n, target, m, stacked);
+	if (!stacked){
+		float c1 = sliceAspect(a, m, target*m/n, c, s), c2 = sliceAspect(a+m, n-m, target*(n-m)/n, c, s);
+		float x = r.x + (r.z-r.x-spacing)*c1/(c1+c2);
+		placeSlices(a, m, glm::vec4(r.x, r.y, x, r.w), spacing, out);
+		placeSlices(a+m, n-m, glm::vec4(x+spacing, r.y, r.z, r.w), spacing, out);
+	}
+	else {
+		float c1 = sliceAspect(a, m, target*n/m, c, s), c2 = sliceAspect(a+m, n-m, target*n/(n-m), c, s);
+		float y = r.w - (r.w-r.y-spacing)*(1/c1)/(1/c1 + 1/c2);
+		placeSlices(a, m, glm::vec4(r.x, y, r.z, r.w), spacing, out);
+		placeSlices(a+m, n-m, glm::vec4(r.x, r.y, r.z, y-spacing), spacing, out);
+	}
+}
+
+
+// ===========================================================
+// class PageLayout
+// ===========================================================
+
+PageLayout::PageLayout(){
+	pageWidth = 100;
+	pageHeight = 70;
+	margin = 4;
+	spacing = 1;
+	pageGap = 10;
+	origin = glm::vec2(0.f, 0.f);
+	minPerPage = 2;
+	maxPerPage = 8;
+	cropWeight = 1;
+	spaceWeight = 1;
+	pageCost = 0.5;
+	styles = (1 << JustifiedRows) | (1 << Grid) | (1 << Collage);
+	nThreads = 0;
+	nPages = 0;
+	score = 0;
+	aspects = NULL;
+	nPhotos = 0;
+}
+
+float PageLayout::aspectOf(Frame * f){
+	if (f->slot != glRenderer->imageLoader.placeholder && f->slot->height > 0) return float(f->slot->width)/f->slot->height;
+	int w, h;
+	if (!f->filename.empty() && readImageSize(f->filename, w, h) && h > 0) return float(w)/h;
+	if (f->y1 == f->y0) return 1;
+	return fabs((f->x1-f->x0)/(f->y1-f->y0));
+}
+
+void PageLayout::apply(const vector <Frame*> &frames, const vector <Cell> &cells){
+	int n = min(frames.size(), cells.size());
+	for (int i=0; i<n; ++i){
+		glm::vec4 r = cells[i].rect;
+		frames[i]->setSize(r.x, r.y, r.z, r.w);
+		frames[i]->setUVRect(cells[i].uvRect);
+	}
+}
+
+
+vector <PageLayout::Cell> PageLayout::layout(const vector <Frame*> &frames){
+	vector <float> a(frames.size());
+	for (int i=0; i<frames.size(); ++i) a[i] = aspectOf(frames[i]);
+	return layout(a);
+}
+
+// The best layout of every run is independent of the others, so the runs are shared out
+// among the threads photo by photo; splitting the album into pages is then cheap.
+vector <PageLayout::Cell> PageLayout::layout(const vector <float> &a){
+	int n = a.size(), kmax = max(maxPerPage, 1);
+	vector <Cell> cells(n);
+	nPages = 0;
+	score = 0;
+	if (n == 0) return cells;
+
+	aspects = &a[0];
+	nPhotos = n;
+	best.assign(n*kmax, PageCandidate());
+	int nt = (nThreads > 0)? nThreads : thread::hardware_concurrency();
+	nt = min(max(nt, 1), n);
+	atomic <int> next(0);
+	vector <thread> threads;
+	for (int t=1; t<nt; ++t) threads.push_back(thread(&PageLayout::worker, this, &next));
+	worker(&next);
+	for (int t=0; t<threads.size(); ++t) threads[t].join();
+
+	// cost[j]: best split of the first j photos into pages
+	vector <float> cost(n+1, 1e30f);
+	vector <int> run(n+1, 0);
+	cost[0] = 0;
+	for (int j=1; j<=n; ++j){
+		for (int k=1; k<=min(kmax, j); ++k){
+			float s = cost[j-k] + best[(j-k)*kmax + k-1].score + pageCost + ((k < minPerPage)? 1 : 0);
+			if (s < cost[j]){
+				cost[j] = s;
+				run[j] = k;
+			}
+		}
+	}
+	vector <int> starts;
+	for (int j=n; j>0; j -= run[j]) starts.push_back(j-run[j]);
+	reverse(starts.begin(), starts.end());
+	nPages = starts.size();
+	score = cost[n];
+
+	for (int p=0; p<nPages; ++p){
+		int i = starts[p], k = ((p+1 < nPages)? starts[p+1] : n) - i;
+		PageCandidate &c = best[i*kmax + k-1];
+		glm::vec2 o = origin + glm::vec2(p*(pageWidth+pageGap) + margin, margin);
+		for (int q=0; q<k; ++q){
+			Cell &cell = cells[i+q];
+			cell.page = p;
+			cell.style = c.style;
+			cell.rect = c.rects[q] + glm::vec4(o, o);
+			cell.uvRect = cropRect(a[i+q], aspectOfRect(c.rects[q]));
+		}
+	}
+	best.clear();
+	aspects = NULL;
+	return cells;
+}
+
+void PageLayout::worker(atomic <int> * next){
+	int kmax = max(maxPerPage, 1);
+	for (int i = (*next)++; i < nPhotos; i = (*next)++) evaluate(i, &best[i*kmax]);
+}
+
+void PageLayout::evaluate(int i, PageCandidate * out){
+	float W = pageWidth - 2*margin, H = pageHeight - 2*margin;
+	int kmax = min(max(maxPerPage, 1), nPhotos-i);
+	for (int k=1; k<=kmax; ++k){
+		PageCandidate &c = out[k-1];
+		c.score = 1e30f;
+		if (styles & (1 << JustifiedRows)) justifiedRows(aspects+i, k, c);
+		if (styles & (1 << Grid)) grid(aspects+i, k, c);
+		if (styles & (1 << Collage)) collage(aspects+i, k, c);
+		if (c.rects.empty()){		// no room for the photos: stack them up, at a high score
+			c.score = 1e6f;
+			c.style = Grid;
+			c.rects.assign(k, glm::vec4(0.f, 0.f, max(W, 1e-3f), max(H, 1e-3f)));
+		}
+	}
+}
+
+// score = cropWeight * area-weighted cropping loss + spaceWeight * uncovered part of the page
+void PageLayout::consider(PageCandidate &c, int style, const float * a, const vector <glm::vec4> &rects){
+	float W = pageWidth - 2*margin, H = pageHeight - 2*margin;
+	float area = 0, crop = 0;
+	for (int i=0; i<rects.size(); ++i){
+		float w = rects[i].z - rects[i].x, h = rects[i].w - rects[i].y;
+		if (w <= 0 || h <= 0) return;
+		area += w*h;
+		crop += w*h*cropLoss(a[i], w/h);
+	}
+	float s = cropWeight*crop/area + spaceWeight*(1 - area/(W*H));
+	if (s >= c.score) return;
+	c.score = s;
+	c.style = style;
+	c.rects = rects;
+}
+
+
+// Rows fill the width at the height given by the sum of their aspects; the rows are
+// broken where the running sum passes a multiple of total/nRows. Rows too tall together
+// are scaled down to the page height, and centred.
+void PageLayout::justifiedRows(const float * a, int n, PageCandidate &c){
+	float W = pageWidth - 2*margin, H = pageHeight - 2*margin;
+	float total = 0;
+	for (int i=0; i<n; ++i) total += a[i];
+	vector <int> ends;
+	vector <glm::vec4> rects;
+	for (int r=1; r<=n; ++r){
+		if (H - spacing*(r-1) <= 0) break;
+		ends.clear();
+		float acc = 0;
+		for (int i=0; i<n-1; ++i){
+			acc += a[i];
+			int row = ends.size();
+			if (row == r-1 || n-1-i < r-row-1) continue;
+			if (n-1-i == r-row-1 || acc - a[i]/2 >= total*(row+1)/r) ends.push_back(i+1);
+		}
+		ends.push_back(n);
+
+		float sumH = 0;
+		vector <float> heights(r), sums(r);
+		for (int j=0, s=0; j<r; s = ends[j++]){
+			sums[j] = 0;
+			for (int i=s; i<ends[j]; ++i) sums[j] += a[i];
+			heights[j] = (W - spacing*(ends[j]-s-1))/sums[j];
+			sumH += heights[j];
+		}
+		float f = min(1.f, (H - spacing*(r-1))/sumH);
+		float y = H - (H - sumH*f - spacing*(r-1))/2;
+		rects.clear();
+		for (int j=0, s=0; j<r; s = ends[j++]){
+			float h = heights[j]*f;
+			float x = (W - sums[j]*h - spacing*(ends[j]-s-1))/2;
+			for (int i=s; i<ends[j]; ++i){
+				rects.push_back(glm::vec4(x, y-h, x + a[i]*h, y));
+				x += a[i]*h + spacing;
+			}
+			y -= h + spacing;
+		}
+		consider(c, JustifiedRows, a, rects);
+	}
+}
+
+// Cells either fill the page or take the geometric mean aspect of the photos; the last
+// row is centred.
+void PageLayout::grid(const float * a, int n, PageCandidate &c){
+	float W = pageWidth - 2*margin, H = pageHeight - 2*margin;
+	float g = 0;
+	for (int i=0; i<n; ++i) g += log(a[i]);
+	g = exp(g/n);
+	vector <glm::vec4> rects;
+	for (int cols=1; cols<=n; ++cols){
+		int rows = (n + cols-1)/cols;
+		float cw = (W - spacing*(cols-1))/cols, ch = (H - spacing*(rows-1))/rows;
+		if (cw <= 0 || ch <= 0) continue;
+		for (int v=0; v<2; ++v){
+			float w = cw, h = ch;
+			if (v == 1){
+				if (g > cw/ch) h = cw/g;
+				else w = ch*g;
+			}
+			float y = H - (H - rows*h - spacing*(rows-1))/2;
+			rects.clear();
+			for (int row=0; row<rows; ++row){
+				int cnt = min(cols, n - row*cols);
+				float x = (W - cnt*w - spacing*(cnt-1))/2;
+				for (int i=0; i<cnt; ++i){
+					rects.push_back(glm::vec4(x, y-h, x+w, y));
+					x += w + spacing;
+				}
+				y -= h + spacing;
+			}
+			consider(c, Grid, a, rects);
+		}
+	}
+}
+
+// The slices either fill the page, cropping where their aspect is not met, or keep the
+// aspect of the tree, centred.
+void PageLayout::collage(const float * a, int n, PageCandidate &c){
+	float W = pageWidth - 2*margin, H = pageHeight - 2*margin;
+	if (W <= 0 || H <= 0) return;
+	vector <glm::vec4> rects;
+	placeSlices(a, n, glm::vec4(0.f, 0.f, W, H), spacing, rects);
+	consider(c, Collage, a, rects);
+
+	int m; bool stacked;
+	float t = sliceAspect(a, n, W/H, m, stacked);
+	glm::vec4 r = (t > W/H)? glm::vec4(0.f, (H - W/t)/2, W, (H + W/t)/2) : glm::vec4((W - H*t)/2, 0.f, (W + H*t)/2, H);
+	rects.clear();
+	placeSlices(a, n, r, spacing, rects);
+	consider(c, Collage, a, rects);
+}
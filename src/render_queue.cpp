@@ -0,0 +1,109 @@
+#include "../headers/graphics.h"
+
+#include <algorithm>
+using namespace std;
+
+// ===========================================================
+// class RenderState
+// ===========================================================
+
+void RenderState::reset(){
+	program = vao = tex2D = texArray = 0xffffffff;	// unknown, so that the first bind always goes through
+	blend = glIsEnabled(GL_BLEND);
+	nDrawCalls = nProgramChanges = nVaoChanges = nTextureChanges = nBlendChanges = 0;
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void RenderState::useProgram(GLuint p){
+	if (p == program) return;
+	glUseProgram(p);
+	program = p;
+	++nProgramChanges;
+}
+
+void RenderState::bindVertexArray(GLuint v){
+	if (v == vao) return;
+	glBindVertexArray(v);
+	vao = v;
+	++nVaoChanges;
+}
+
+void RenderState::bindTexture(GLenum target, GLuint t){
+	GLuint &bound = (target == GL_TEXTURE_2D_ARRAY)? texArray : tex2D;
+	if (t == bound) return;
+	glBindTexture(target, t);
+	bound = t;
+	++nTextureChanges;
+}
+
+void RenderState::setBlend(bool b){
+	if (b == blend) return;
+	if (b) glEnable(GL_BLEND);
+	else   glDisable(GL_BLEND);
+	blend = b;
+	++nBlendChanges;
+}
+
+void RenderState::print(){
+	cout << "draws = " << nDrawCalls << ", program/vao/texture/blend changes = " 
+	     << nProgramChanges << "/" << nVaoChanges << "/" << nTextureChanges << "/" << nBlendChanges << '\n';
+}
+
+
+// ===========================================================
+// class RenderQueue
+// ===========================================================
+
+// Key layout (most significant first):
+//   opaque:      0 | program (16) | texture (24) | vao (23)
+//   transparent: 1 | layer (16)   | program (16) | texture (16) | vao (15)
+// Ids are truncated to their field width, which can only cost a few extra state changes.
+unsigned long long RenderQueue::sortKey(Shape * s){
+	typedef unsigned long long u64;
+	u64 prog = s->program_id;
+	u64 tex  = s->tex;
+	u64 vao  = s->vao;
+	if (s->blendMode == BlendOpaque){
+		return (prog & 0xffff) << 47 | (tex & 0xffffff) << 23 | (vao & 0x7fffff);
+	}
+	else{
+		u64 layer = u64(min(max(s->layer + 32768, 0), 65535));
+		return u64(1) << 63 | layer << 47 | (prog & 0xffff) << 31 | (tex & 0xffff) << 15 | (vao & 0x7fff);
+	}
+}
+
+
+bool compare_keys(const RenderQueue::Item &a, const RenderQueue::Item &b){
+	return a.key < b.key;
+}
+
+void RenderQueue::build(vector <Shape*> &shapes){
+	items.clear();
+	for (int i=0; i<shapes.size(); ++i){
+		if (!shapes[i]->b_render) continue;
+		if (glRenderer->b_exporting && !shapes[i]->b_export) continue;
+		Item it = {sortKey(shapes[i]), shapes[i]};
+		items.push_back(it);
+	}
+	stable_sort(items.begin(), items.end(), compare_keys);	// stable, so that equal keys keep insertion order
+}
+
+
+void RenderQueue::submit(){
+	RenderState &state = glRenderer->state;
+	state.reset();
+	
+	for (int i=0; i<items.size(); ++i){
+		bool b = (items[i].shape->blendMode != BlendOpaque);
+		if (b != state.blend) glRenderer->frameRenderer.flush();	// queued frames must be drawn with the old blend state
+		state.setBlend(b);
+		items[i].shape->render();
+	}
+	glRenderer->frameRenderer.flush();
+	
+	state.bindVertexArray(0);
+	state.setBlend(true);	// default state set in init_hyperGL
+	
+	stats = state;
+}
+
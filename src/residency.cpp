@@ -0,0 +1,206 @@
+#include "../headers/graphics.h"
+#include "../headers/residency.h"
+
+#include <algorithm>
+using namespace std;
+
+// ===========================================================
+// class ResidencyManager
+// ===========================================================
+
+ResidencyManager::ResidencyManager(){
+	budget = size_t(512)*1024*1024;
+	maxTiles = 256;
+	frameNumber = 0;
+	nResident = nDowngraded = nEvicted = 0;
+	nDowngrades = nEvictions = 0;
+}
+
+void ResidencyManager::add(Frame * f){
+	frames.push_back(f);
+}
+
+void ResidencyManager::remove(Frame * f){
+	vector <Frame*>::iterator it = find(frames.begin(), frames.end(), f);
+	if (it != frames.end()) frames.erase(it);
+}
+
+
+size_t ResidencyManager::usedBytes(){
+	return glRenderer->texturePool.gpuBytes();
+}
+
+bool ResidencyManager::fits(size_t bytes){
+	return usedBytes() + bytes <= budget;
+}
+
+
+static bool lessRecentlyUsed(const Frame * a, const Frame * b){
+	return a->lastUsed < b->lastUsed;
+}
+
+static bool lessRecentlyDrawn(const TileUse &a, const TileUse &b){
+	return a.lastUsed < b.lastUsed;
+}
+
+int ResidencyManager::limitTiles(long long before){
+	vector <TileUse> tiles;
+	for (int i=0; i<frames.size(); ++i) if (frames[i]->vt != NULL) frames[i]->vt->residentTiles(tiles);
+	if (tiles.size() <= maxTiles) return 0;
+	
+	sort(tiles.begin(), tiles.end(), lessRecentlyDrawn);
+	int n = 0;
+	for (int i=0; i<tiles.size() && tiles.size()-n > maxTiles && tiles[i].lastUsed < before; ++i, ++n){
+		tiles[i].vt->releaseTile(tiles[i].key);
+	}
+	return n;
+}
+
+void ResidencyManager::update(){
+	++frameNumber;
+	
+	nResident = nDowngraded = nEvicted = 0;
+	for (int i=0; i<frames.size(); ++i){
+		Frame * f = frames[i];
+		if (f->screenArea() > 0){
+			f->lastUsed = frameNumber;
+			// visible again after an eviction, or zoomed in beyond the resident detail: stream the image in
+			if (!f->b_loading && !f->b_loadFailed){
+				if (f->residency == Evicted) glRenderer->imageLoader.request(f, f->filename, ThumbStage);
+				else {
+					int need = f->requiredLimit();
+					if (need > f->residentLimit) glRenderer->imageLoader.request(f, f->filename, LodStage, need);
+				}
+			}
+		}
+		if      (f->residency == FullRes)   ++nResident;
+		else if (f->residency == Thumbnail) ++nDowngraded;
+		else                                ++nEvicted;
+	}
+	
+	TexturePool &pool = glRenderer->texturePool;
+	limitTiles(frameNumber);	// tiles on screen now stay
+	size_t used = usedBytes();
+	if (used <= budget) return;
+	size_t freed = pool.compact();
+	used -= freed;
+	
+	// frames not visible in this frame, least recently used first
+	vector <Frame*> lru;
+	for (int i=0; i<frames.size(); ++i) if (frames[i]->lastUsed < frameNumber) lru.push_back(frames[i]);
+	sort(lru.begin(), lru.end(), lessRecentlyUsed);
+	
+	// The layers given up are counted as freed, which they are once the pool is compacted. 
+	// A photo shared by several frames only frees its memory once all of them have let go of it.
+	size_t given = 0;
+	for (int i=0; i<lru.size() && used > budget + given; ++i){
+		if (lru[i]->residency != FullRes) continue;
+		given += downgrade(lru[i]);
+		if (lru[i]->residency == Thumbnail){ --nResident; ++nDowngraded; }
+	}
+	for (int i=0; i<lru.size() && used > budget + given; ++i){
+		if (lru[i]->residency == Evicted) continue;
+		if (lru[i]->residency == FullRes) --nResident; else --nDowngraded;
+		given += evict(lru[i]);
+		++nEvicted;
+	}
+	if (given > 0) freed += pool.compact();
+	
+	// images moved by the compaction are in other array textures
+	if (freed > 0) for (int i=0; i<frames.size(); ++i) frames[i]->tex = frames[i]->slot->tex;
+}
+
+
+// The thumbnail is the frame's own mip chain from the first level that fits 
+// ImageLoader::thumbSize, copied on the GPU into a free layer of the size class 
+// a thumbnail of that size gets from the loader. A page is only added for it where
+// the page costs less than the layer given up, so that the pool never grows.
+size_t ResidencyManager::downgrade(Frame * f){
+	if (!GLEW_ARB_copy_image) return 0;
+	
+	TexturePool &pool = glRenderer->texturePool;
+	TextureSlot * slot = f->slot;
+	TexturePage * p = slot->page;
+	
+	int k = 0;
+	while (max(slot->width>>k, slot->height>>k) > glRenderer->imageLoader.thumbSize) ++k;
+	if (k == 0 || k >= p->nLevels) return 0;	// already small
+	
+	int W = pool.classSize(max(slot->width>>k, 1)), H = pool.classSize(max(slot->height>>k, 1));
+	// level l of the thumbnail is copied from level k+l, the last levels from the smallest one
+	if (isCompressedFormat(p->format)){
+		// copies of compressed blocks must be whole blocks, or reach the edge of both levels
+		for (int l=0; l<mipLevels(W, H); ++l){
+			int s = min(k+l, p->nLevels-1);
+			int sw = max(p->width>>s,1), sh = max(p->height>>s,1);
+			int dw = max(W>>l,1), dh = max(H>>l,1);
+			int w = min(sw, dw), h = min(sh, dh);
+			if ((w%4 != 0 && (w != sw || w != dw)) || (h%4 != 0 && (h != sh || h != dh))) return 0;
+		}
+	}
+	
+	// the thumbnail of a shared photo may exist already
+	size_t added = 0;
+	TextureSlot * thumb = pool.findShared(slot->hash, max(slot->width>>k, 1), max(slot->height>>k, 1), p->format);
+	if (thumb == NULL){
+		thumb = pool.allocate(W, H, p->format, false);
+		if (thumb == NULL && slot->refCount == 1 && pool.newPageBytes(W, H, p->format) < p->layerBytes()){
+			added = pool.newPageBytes(W, H, p->format);
+			thumb = pool.allocate(W, H, p->format);
+		}
+		if (thumb == NULL) return 0;
+		TexturePage * q = thumb->page;
+		for (int l=0; l<q->nLevels; ++l){
+			int s = min(k+l, p->nLevels-1);
+			int w = min(max(p->width>>s,1), max(q->width>>l,1));
+			int h = min(max(p->height>>s,1), max(q->height>>l,1));
+			glCopyImageSubData(p->tex, GL_TEXTURE_2D_ARRAY, s,   0, 0, slot->layer, 
+			                   q->tex, GL_TEXTURE_2D_ARRAY, l,   0, 0, thumb->layer, w, h, 1);
+		}
+		thumb->width  = max(slot->width>>k, 1);
+		thumb->height = max(slot->height>>k, 1);
+		thumb->uvRect = glm::vec4(0.f, 0.f, float(thumb->width)/q->width, float(thumb->height)/q->height);
+		pool.share(thumb, slot->hash);
+	}
+	
+	size_t given = (slot->refCount == 1)? p->layerBytes() - added : 0;
+	if (slot->refCount == 1 && thumb->refCount == 1){
+		pool.swapStorage(slot, thumb);
+		pool.release(thumb);	// now holds the full resolution layer
+	}
+	else {
+		// other frames keep showing the full resolution photo
+		pool.release(slot);
+		f->slot = slot = thumb;
+	}
+	f->tex = slot->tex;
+	f->residency = Thumbnail;
+	f->residentLimit = glRenderer->imageLoader.thumbSize;
+	++nDowngrades;
+	return given;
+}
+
+size_t ResidencyManager::evict(Frame * f){
+	TexturePool &pool = glRenderer->texturePool;
+	size_t given = (f->slot->refCount == 1)? f->slot->page->layerBytes() : 0;
+	pool.retain(glRenderer->imageLoader.placeholder);
+	pool.release(f->slot);
+	if (f->vt != NULL){
+		given += f->vt->residentBytes();
+		f->vt->releaseTiles();
+	}
+	f->slot = glRenderer->imageLoader.placeholder;
+	f->tex = f->slot->tex;
+	f->blendMode = BlendOpaque;
+	f->residency = Evicted;
+	f->residentLimit = 0;
+	++nEvictions;
+	return given;
+}
+
+
+void ResidencyManager::printStats(){
+	cout << "Residency: " << nResident << " full, " << nDowngraded << " thumbnail, " << nEvicted << " evicted; " 
+	     << usedBytes()/1024.f/1024.f << " / " << budget/1024.f/1024.f << " MB (" 
+	     << nDowngrades << " downgrades, " << nEvictions << " evictions so far)\n";
+}
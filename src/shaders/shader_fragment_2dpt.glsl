@@ -1,10 +1,19 @@
 #version 400
  
 in vec4 ex_Color;
+#ifdef PICK
+uniform uint pickId;
+out uint outId;
+#else
 out vec4 out_Color;
+#endif
  
 void main(void){
+#ifdef PICK
+	outId = pickId;
+#else
 	out_Color = ex_Color;
+#endif
 }
 
 
@@ -2,10 +2,19 @@
  
 in vec4 ex_col;
 
+#ifdef PICK
+uniform uint pickId;
+out uint outId;
+#else
 out vec4 outColor;
+#endif
  
 void main(void){
+#ifdef PICK
+	outId = pickId;
+#else
 	outColor = ex_col;
+#endif
 }
 
 
@@ -0,0 +1,23 @@
+#version 330
+ 
+in vec2 ex_UV;
+flat in float ex_slice;
+
+#ifdef PICK
+flat in uint ex_id;
+out uint outId;
+#else
+out vec4 outColor;
+#endif
+
+uniform sampler2DArray tex;
+
+void main(void){
+#ifdef PICK
+	if (texture(tex, vec3(ex_UV, ex_slice)).a < 0.5) discard;	// masked out parts of the image are not hit
+	outId = ex_id;
+#else
+	outColor = texture(tex, vec3(ex_UV, ex_slice));
+#endif
+}
+
@@ -3,12 +3,21 @@
 in vec4 ex_col;
 in vec2 ex_UV;
 
+#ifdef PICK
+uniform uint pickId;
+out uint outId;
+#else
 out vec4 outColor;
+#endif
 
 uniform sampler2D tex;
 
 void main(void){
+#ifdef PICK
+	outId = pickId;
+#else
 	outColor = texture(tex, ex_UV);//+ex_col;
+#endif
 }
 
 
@@ -6,11 +6,17 @@ out vec4 ex_col;
 
 uniform float psize;
 
+layout(std140) uniform Camera{
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+};
+
 uniform mat4 model;
 
 void main(void){
 	gl_PointSize = psize;
-	gl_Position = model*vec4(in_pos,1);
+	gl_Position = viewProjection*model*vec4(in_pos,1);
 	ex_col = in_col;
 }
 
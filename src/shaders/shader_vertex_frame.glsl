@@ -0,0 +1,32 @@
+#version 330
+ 
+layout(location=0) in vec2 in_pos;		// unit quad corner
+layout(location=2) in vec2 in_UV;
+layout(location=3) in vec4 in_rect;		// per frame: x0, y0, x1, y1
+layout(location=4) in vec4 in_uvRect;	// per frame: u0, v0, du, dv
+layout(location=5) in vec2 in_zSlice;	// per frame: depth, texture layer
+
+out vec2 ex_UV;
+flat out float ex_slice;
+
+#ifdef PICK
+uniform uint firstId;	// id of the first instance of the draw call
+flat out uint ex_id;
+#endif
+
+layout(std140) uniform Camera{
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+};
+
+void main(void){
+	vec2 p = in_rect.xy + in_pos*(in_rect.zw - in_rect.xy);
+	gl_Position = viewProjection*vec4(p, in_zSlice.x, 1);
+	ex_UV = in_uvRect.xy + in_UV*in_uvRect.zw;
+	ex_slice = in_zSlice.y;
+#ifdef PICK
+	ex_id = firstId + uint(gl_InstanceID);
+#endif
+}
+
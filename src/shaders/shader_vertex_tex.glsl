@@ -7,10 +7,16 @@ in vec2 in_UV;
 out vec4 ex_col;
 out vec2 ex_UV;
 
+layout(std140) uniform Camera{
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+};
+
 uniform mat4 model;
 
 void main(void){
-	gl_Position = model*vec4(in_pos,1);
+	gl_Position = viewProjection*model*vec4(in_pos,1);
 	ex_col = in_col;
 	ex_UV = in_UV;
 }
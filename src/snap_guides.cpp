@@ -0,0 +1,295 @@
+#include "../headers/graphics.h"
+#include "../headers/snap_guides.h"
+
+#include <algorithm>
+#include <cmath>
+using namespace std;
+
+enum SnapType {SnapNone, SnapEdge, SnapPage, SnapSpacing};
+
+// extent of a frame along an axis (0: x, 1: y), whichever way round its corners are
+static float lowOf(Frame * f, int axis){
+	return (axis == 0)? min(f->x0, f->x1) : min(f->y0, f->y1);
+}
+
+static float highOf(Frame * f, int axis){
+	return (axis == 0)? max(f->x0, f->x1) : max(f->y0, f->y1);
+}
+
+// segment from a to b along the axis, at c on the other axis
+static SnapGuides::Line axisLine(int axis, float a, float b, float c){
+	SnapGuides::Line l;
+	l.a = (axis == 0)? glm::vec2(a, c) : glm::vec2(c, a);
+	l.b = (axis == 0)? glm::vec2(b, c) : glm::vec2(c, b);
+	return l;
+}
+
+// middle of the overlap of g with lo..hi across the axis
+static float overlapMid(Frame * g, int other, float lo, float hi){
+	return (max(lowOf(g, other), lo) + min(highOf(g, other), hi))/2;
+}
+
+void SnapGuides::consider(Candidate &best, float shift, int type, float pos){
+	if (fabs(shift) >= best.dist) return;
+	best.shift = shift;
+	best.dist = fabs(shift);
+	best.type = type;
+	best.pos = pos;
+}
+
+
+// ===========================================================
+// class SnapGuides
+// ===========================================================
+
+SnapGuides::SnapGuides(){
+	b_enabled = true;
+	tolerance = 6;
+	maxScan = 32;
+	maxLines = 16;
+	page = glm::vec4(0.f);
+	lines = NULL;
+	linesCapacity = 0;
+}
+
+void SnapGuides::insert(Frame * f){
+	Entry &e = entries[f];
+	for (int a=0; a<2; ++a){
+		float lo = lowOf(f, a), hi = highOf(f, a);
+		e.it[a][0] = edges[a][0].insert(make_pair(lo, f));
+		e.it[a][1] = edges[a][1].insert(make_pair((lo+hi)/2, f));
+		e.it[a][2] = edges[a][2].insert(make_pair(hi, f));
+	}
+}
+
+void SnapGuides::update(Frame * f){
+	map <Frame*, Entry>::iterator it = entries.find(f);
+	if (it == entries.end()) return;
+	Entry &e = it->second;
+	for (int a=0; a<2; ++a){
+		float lo = lowOf(f, a), hi = highOf(f, a);
+		float v[3] = {lo, (lo+hi)/2, hi};
+		for (int k=0; k<3; ++k){
+			if (e.it[a][k]->first == v[k]) continue;
+			edges[a][k].erase(e.it[a][k]);
+			e.it[a][k] = edges[a][k].insert(make_pair(v[k], f));
+		}
+	}
+}
+
+void SnapGuides::remove(Frame * f){
+	map <Frame*, Entry>::iterator it = entries.find(f);
+	if (it == entries.end()) return;
+	for (int a=0; a<2; ++a)
+		for (int k=0; k<3; ++k)
+			edges[a][k].erase(it->second.it[a][k]);
+	entries.erase(it);
+}
+
+void SnapGuides::setPage(float x0, float y0, float x1, float y1, float margin){
+	page = glm::vec4(x0, y0, x1, y1);
+	for (int a=0; a<2; ++a){
+		float lo = min(page[a], page[a+2]), hi = max(page[a], page[a+2]);
+		float g[5] = {lo, lo+margin, (lo+hi)/2, hi-margin, hi};
+		pageGuides[a].assign(g, g+5);
+		sort(pageGuides[a].begin(), pageGuides[a].end());
+	}
+}
+
+
+// Nearest edge, centre or page guide to any of the dragged coordinates m, closer than best.dist
+// (the tolerance to begin with). Each list holds one entry of the dragged frame, so the walk 
+// from the lookup position is short.
+void SnapGuides::align(Frame * f, int axis, const float * m, int nm, Candidate &best){
+	for (int j=0; j<nm; ++j){
+		for (int k=0; k<3; ++k){
+			EdgeList &l = edges[axis][k];
+			EdgeList::iterator start = l.lower_bound(m[j]);
+			for (EdgeList::iterator it = start; it != l.end() && it->first - m[j] < best.dist; ++it){
+				if (it->second == f || !it->second->b_render) continue;
+				consider(best, it->first - m[j], SnapEdge, it->first);
+				break;
+			}
+			for (EdgeList::iterator it = start; it != l.begin(); ){
+				--it;
+				if (m[j] - it->first >= best.dist) break;
+				if (it->second == f || !it->second->b_render) continue;
+				consider(best, it->first - m[j], SnapEdge, it->first);
+				break;
+			}
+		}
+		vector <float> &g = pageGuides[axis];
+		vector <float>::iterator p = lower_bound(g.begin(), g.end(), m[j]);
+		if (p != g.end()) consider(best, *p - m[j], SnapPage, *p);
+		if (p != g.begin()) consider(best, *(p-1) - m[j], SnapPage, *(p-1));
+	}
+}
+
+// closest frame entirely below (or above) v on the axis which overlaps lo..hi across it
+Frame * SnapGuides::neighbour(int axis, float v, bool below, float lo, float hi, Frame * skip1, Frame * skip2){
+	int other = 1-axis, n = 0;
+	if (below){
+		EdgeList &l = edges[axis][2];
+		for (EdgeList::iterator it = l.upper_bound(v); it != l.begin() && n < maxScan; ){
+			--it;
+			Frame * g = it->second;
+			if (g == skip1 || g == skip2 || !g->b_render) continue;
+			++n;
+			if (lowOf(g, other) < hi && highOf(g, other) > lo) return g;
+		}
+	}
+	else {
+		EdgeList &l = edges[axis][0];
+		for (EdgeList::iterator it = l.lower_bound(v); it != l.end() && n < maxScan; ++it){
+			Frame * g = it->second;
+			if (g == skip1 || g == skip2 || !g->b_render) continue;
+			++n;
+			if (lowOf(g, other) < hi && highOf(g, other) > lo) return g;
+		}
+	}
+	return NULL;
+}
+
+// Equal gaps: centred between the neighbours A and B on either side, or repeating
+// the gap between A and its neighbour A2 (B and B2). Gaps are drawn across the middle
+// of the overlap of the two frames they separate.
+void SnapGuides::spacing(Frame * f, int axis, glm::vec4 r, float tol, Candidate &best){
+	int other = 1-axis;
+	float lo = min(r[axis], r[axis+2]), hi = max(r[axis], r[axis+2]), w = hi-lo;
+	float olo = min(r[other], r[other+2]), ohi = max(r[other], r[other+2]);
+	Frame * A = neighbour(axis, lo+tol, true, olo, ohi, f, NULL);
+	Frame * B = neighbour(axis, hi-tol, false, olo, ohi, f, NULL);
+	if (A != NULL && B != NULL){
+		float lo2 = (highOf(A, axis) + lowOf(B, axis) - w)/2;
+		if (lo2 >= highOf(A, axis) && fabs(lo2-lo) < best.dist){
+			consider(best, lo2-lo, SnapSpacing, lo2);
+			best.gaps[0] = axisLine(axis, highOf(A, axis), lo2, overlapMid(A, other, olo, ohi));
+			best.gaps[1] = axisLine(axis, lo2+w, lowOf(B, axis), overlapMid(B, other, olo, ohi));
+		}
+	}
+	if (A != NULL){
+		Frame * A2 = neighbour(axis, lowOf(A, axis), true, lowOf(A, other), highOf(A, other), f, A);
+		if (A2 != NULL){
+			float lo2 = highOf(A, axis) + lowOf(A, axis) - highOf(A2, axis);
+			if (fabs(lo2-lo) < best.dist){
+				consider(best, lo2-lo, SnapSpacing, lo2);
+				best.gaps[0] = axisLine(axis, highOf(A2, axis), lowOf(A, axis), overlapMid(A, other, lowOf(A2, other), highOf(A2, other)));
+				best.gaps[1] = axisLine(axis, highOf(A, axis), lo2, overlapMid(A, other, olo, ohi));
+			}
+		}
+	}
+	if (B != NULL){
+		Frame * B2 = neighbour(axis, highOf(B, axis), false, lowOf(B, other), highOf(B, other), f, B);
+		if (B2 != NULL){
+			float hi2 = lowOf(B, axis) - (lowOf(B2, axis) - highOf(B, axis));
+			if (fabs(hi2-hi) < best.dist){
+				consider(best, hi2-hi, SnapSpacing, hi2);
+				best.gaps[0] = axisLine(axis, hi2, lowOf(B, axis), overlapMid(B, other, olo, ohi));
+				best.gaps[1] = axisLine(axis, highOf(B, axis), lowOf(B2, axis), overlapMid(B, other, lowOf(B2, other), highOf(B2, other)));
+			}
+		}
+	}
+}
+
+
+// An alignment line spans the dragged frame and all frames with an edge or centre on it.
+void SnapGuides::addGuides(Frame * f, int axis, glm::vec4 r, const Candidate &c){
+	int other = 1-axis;
+	if (c.type == SnapSpacing){
+		active.push_back(c.gaps[0]);
+		active.push_back(c.gaps[1]);
+		return;
+	}
+	float lo = min(r[other], r[other+2]), hi = max(r[other], r[other+2]);
+	if (c.type == SnapPage){
+		lo = min(lo, min(page[other], page[other+2]));
+		hi = max(hi, max(page[other], page[other+2]));
+	}
+	else {
+		float eps = 1e-3f*max(fabs(c.pos), 1.f);
+		for (int k=0; k<3; ++k){
+			EdgeList &l = edges[axis][k];
+			int n = 0;
+			for (EdgeList::iterator it = l.lower_bound(c.pos-eps); it != l.end() && it->first <= c.pos+eps && n < maxScan; ++it, ++n){
+				if (it->second == f || !it->second->b_render) continue;
+				lo = min(lo, lowOf(it->second, other));
+				hi = max(hi, highOf(it->second, other));
+			}
+		}
+	}
+	active.push_back(axisLine(other, lo, hi, c.pos));
+}
+
+
+glm::vec4 SnapGuides::snapMove(Frame * f, glm::vec4 r){
+	active.clear();
+	if (b_enabled){
+		Camera &cam = glRenderer->camera;
+		float tol[2] = {tolerance*(cam.xmax-cam.xmin)/cam.viewport[2], tolerance*(cam.ymax-cam.ymin)/cam.viewport[3]};
+		Candidate best[2];
+		for (int a=0; a<2; ++a){
+			float lo = min(r[a], r[a+2]), hi = max(r[a], r[a+2]);
+			float m[3] = {lo, (lo+hi)/2, hi};
+			best[a].dist = tol[a];
+			best[a].shift = 0;
+			best[a].type = SnapNone;
+			align(f, a, m, 3, best[a]);
+			spacing(f, a, r, tol[a], best[a]);
+			r[a] += best[a].shift;
+			r[a+2] += best[a].shift;
+		}
+		for (int a=0; a<2; ++a) if (best[a].type != SnapNone) addGuides(f, a, r, best[a]);
+	}
+	show();
+	return r;
+}
+
+glm::vec4 SnapGuides::snapResize(Frame * f, glm::vec4 r){
+	active.clear();
+	if (b_enabled){
+		Camera &cam = glRenderer->camera;
+		float tol[2] = {tolerance*(cam.xmax-cam.xmin)/cam.viewport[2], tolerance*(cam.ymax-cam.ymin)/cam.viewport[3]};
+		Candidate best[2];
+		for (int a=0; a<2; ++a){
+			best[a].dist = tol[a];
+			best[a].shift = 0;
+			best[a].type = SnapNone;
+			align(f, a, &r[a+2], 1, best[a]);
+			r[a+2] += best[a].shift;
+		}
+		for (int a=0; a<2; ++a) if (best[a].type != SnapNone) addGuides(f, a, r, best[a]);
+	}
+	show();
+	return r;
+}
+
+void SnapGuides::clear(){
+	active.clear();
+	show();
+}
+
+// the line shape has room for the maxLines of its creation, and draws the first nVertices
+void SnapGuides::show(){
+	if (lines == NULL){
+		if (active.empty()) return;
+		linesCapacity = maxLines;
+		lines = new Shape(2*linesCapacity, 3, "lines");
+		lines->b_pickable = false;
+		lines->b_export = false;
+		vector <float> col(4*2*linesCapacity);
+		for (int i=0; i<2*linesCapacity; ++i){
+			col[4*i] = 1; col[4*i+1] = 0; col[4*i+2] = 1; col[4*i+3] = 1;
+		}
+		lines->setColors(&col[0]);
+	}
+	int n = min(int(active.size()), min(maxLines, linesCapacity));
+	vector <float> pos(6*n);
+	for (int i=0; i<n; ++i){
+		float v[6] = {active[i].a.x, active[i].a.y, 100, active[i].b.x, active[i].b.y, 100};
+		copy(v, v+6, &pos[6*i]);
+	}
+	lines->nVertices = 2*n;
+	if (n > 0) lines->setVertices(&pos[0]);
+	lines->b_render = (n > 0);
+	glRenderer->markDirty();
+}
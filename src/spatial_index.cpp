@@ -0,0 +1,129 @@
+#include "../headers/graphics.h"
+#include "../headers/spatial_index.h"
+
+#include <algorithm>
+#include <cmath>
+using namespace std;
+
+// ===========================================================
+// class SpatialIndex
+// ===========================================================
+
+SpatialIndex::SpatialIndex(){
+	cellSize = 5;
+	maxCells = 64;
+	nextOrder = 0;
+}
+
+long long SpatialIndex::cellKey(int cx, int cy){
+	return ((long long)cx << 32) | (unsigned int)cy;
+}
+
+// the range is computed in double, so that a frame far out or huge
+// goes to the large list instead of overflowing the cell coordinates
+void SpatialIndex::cellRange(Frame * f, Entry &e){
+	double cx0 = floor(min(f->x0, f->x1)/cellSize), cx1 = floor(max(f->x0, f->x1)/cellSize);
+	double cy0 = floor(min(f->y0, f->y1)/cellSize), cy1 = floor(max(f->y0, f->y1)/cellSize);
+	if ((cx1-cx0+1)*(cy1-cy0+1) > maxCells || !(fabs(cx0) < 1e9 && fabs(cy0) < 1e9)){
+		e.cx0 = e.cy0 = 0;
+		e.cx1 = e.cy1 = -1;
+	}
+	else {
+		e.cx0 = cx0; e.cx1 = cx1;
+		e.cy0 = cy0; e.cy1 = cy1;
+	}
+}
+
+void SpatialIndex::link(Frame * f, const Entry &e){
+	if (e.cx1 < e.cx0){
+		large.push_back(f);
+		return;
+	}
+	for (int cy=e.cy0; cy<=e.cy1; ++cy)
+		for (int cx=e.cx0; cx<=e.cx1; ++cx)
+			cells[cellKey(cx, cy)].push_back(f);
+}
+
+void SpatialIndex::unlink(Frame * f, const Entry &e){
+	if (e.cx1 < e.cx0){
+		large.erase(find(large.begin(), large.end(), f));
+		return;
+	}
+	for (int cy=e.cy0; cy<=e.cy1; ++cy){
+		for (int cx=e.cx0; cx<=e.cx1; ++cx){
+			map <long long, vector <Frame*> >::iterator c = cells.find(cellKey(cx, cy));
+			vector <Frame*> &v = c->second;
+			*find(v.begin(), v.end(), f) = v.back();
+			v.pop_back();
+			if (v.empty()) cells.erase(c);
+		}
+	}
+}
+
+
+void SpatialIndex::insert(Frame * f){
+	Entry e;
+	cellRange(f, e);
+	e.order = nextOrder++;
+	entries[f] = e;
+	link(f, e);
+}
+
+void SpatialIndex::update(Frame * f){
+	map <Frame*, Entry>::iterator it = entries.find(f);
+	if (it == entries.end()) return;
+	Entry e = it->second;
+	cellRange(f, e);
+	if (e.cx0 == it->second.cx0 && e.cx1 == it->second.cx1 && e.cy0 == it->second.cy0 && e.cy1 == it->second.cy1) return;
+	unlink(f, it->second);
+	link(f, e);
+	it->second = e;
+}
+
+void SpatialIndex::remove(Frame * f){
+	map <Frame*, Entry>::iterator it = entries.find(f);
+	if (it == entries.end()) return;
+	unlink(f, it->second);
+	entries.erase(it);
+}
+
+void SpatialIndex::setCellSize(float s){
+	cellSize = s;
+	cells.clear();
+	large.clear();
+	for (map <Frame*, Entry>::iterator it = entries.begin(); it != entries.end(); ++it){
+		cellRange(it->first, it->second);
+		link(it->first, it->second);
+	}
+}
+
+int SpatialIndex::size(){
+	return entries.size();
+}
+
+
+Frame * SpatialIndex::topmost(float x, float y){
+	const vector <Frame*> * lists[2] = {&large, NULL};
+	double cx = floor(x/cellSize), cy = floor(y/cellSize);
+	if (fabs(cx) < 1e9 && fabs(cy) < 1e9){
+		map <long long, vector <Frame*> >::iterator c = cells.find(cellKey(cx, cy));
+		if (c != cells.end()) lists[1] = &c->second;
+	}
+
+	Frame * top = NULL;
+	long long topOrder = -1;
+	for (int l=0; l<2; ++l){
+		if (lists[l] == NULL) continue;
+		for (int i=0; i<lists[l]->size(); ++i){
+			Frame * f = (*lists[l])[i];
+			if (!f->b_render || !f->b_pickable || f->layer < 0) continue;	// hidden, or a backdrop
+			if (!(x > min(f->x0, f->x1) && x < max(f->x0, f->x1) && y > min(f->y0, f->y1) && y < max(f->y0, f->y1))) continue;
+			long long order = entries[f].order;
+			if (top == NULL || f->layer > top->layer || (f->layer == top->layer && order > topOrder)){
+				top = f;
+				topOrder = order;
+			}
+		}
+	}
+	return top;
+}
@@ -0,0 +1,437 @@
+#include "../headers/texture_pool.h"
+#include "../headers/bc_encoder.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+
+// ===========================================================
+// image helpers
+// ===========================================================
+
+void downsampleImage(const unsigned char * src, int w, int h, unsigned char * dst){
+	int w2 = max(w/2, 1), h2 = max(h/2, 1);
+	for (int j=0; j<h2; ++j){
+		const unsigned char * r0 = src + 4*w*min(2*j,   h-1);
+		const unsigned char * r1 = src + 4*w*min(2*j+1, h-1);
+		for (int i=0; i<w2; ++i){
+			int i0 = 4*min(2*i, w-1), i1 = 4*min(2*i+1, w-1);
+			for (int c=0; c<4; ++c) 
+				dst[4*(j*w2+i)+c] = (r0[i0+c] + r0[i1+c] + r1[i0+c] + r1[i1+c] + 2)/4;
+		}
+	}
+}
+
+bool imageHasAlpha(const unsigned char * src, int w, int h){
+	size_t n = size_t(w)*h;
+	for (size_t i=0; i<n; ++i) if (src[4*i+3] != 255) return true;
+	return false;
+}
+
+void padImage(const unsigned char * src, int w, int h, unsigned char * dst, int W, int H){
+	for (int j=0; j<H; ++j){
+		const unsigned char * s = src + 4*w*min(j, h-1);
+		unsigned char * d = dst + 4*W*j;
+		memcpy(d, s, 4*w);
+		for (int i=w; i<W; ++i) memcpy(d+4*i, s+4*(w-1), 4);	// replicate the last column so that filtering does not bleed
+	}
+}
+
+// FNV-1a on 8 byte words with an xor-shift per step, so that the high bytes
+// of a word also reach the low bits of the hash
+unsigned long long hashBytes(const void * data, size_t n, unsigned long long hsh){
+	const unsigned char * p = (const unsigned char*)data;
+	size_t i = 0;
+	for (; i+8 <= n; i += 8){
+		unsigned long long v;
+		memcpy(&v, p+i, 8);
+		hsh = (hsh ^ v) * 1099511628211ULL;
+		hsh ^= hsh >> 32;
+	}
+	for (; i<n; ++i) hsh = (hsh ^ p[i]) * 1099511628211ULL;
+	return hsh;
+}
+
+unsigned long long hashImage(const unsigned char * pixels, int w, int h){
+	int size[2] = {w, h};
+	unsigned long long hsh = hashBytes(size, sizeof(size));
+	hsh = hashBytes(pixels, size_t(w)*h*4, hsh);
+	return (hsh == 0)? 1 : hsh;
+}
+
+bool isCompressedFormat(GLenum format){
+	return format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT || format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+size_t levelBytes(GLenum format, int w, int h){
+	if (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) return bcLevelBytes(w, h, 8);
+	if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) return bcLevelBytes(w, h, 16);
+	return size_t(w)*h*4;
+}
+
+int mipLevels(int W, int H){
+	int n = 1;
+	while ((max(W,H) >> n) > 0) ++n;
+	return n;
+}
+
+void buildMipChain(const unsigned char * pixels, int width, int height, int w, int h, int W, int H, vector <unsigned char> &levels, vector <size_t> &offsets){
+	const unsigned char * src = pixels;
+	vector <unsigned char> a, b;
+	while (width > w || height > h){
+		int w2 = max(width/2,1), h2 = max(height/2,1);
+		a.resize(size_t(w2)*h2*4);
+		downsampleImage(src, width, height, &a[0]);
+		a.swap(b);
+		src = &b[0];
+		width = w2; height = h2;
+	}
+	
+	int n = mipLevels(W, H);
+	size_t total = 0;
+	for (int l=0; l<n; ++l) total += size_t(max(W>>l,1))*max(H>>l,1)*4;
+	levels.resize(total);
+	offsets.resize(n);
+	
+	offsets[0] = 0;
+	padImage(src, width, height, &levels[0], W, H);
+	int lw = W, lh = H;
+	for (int l=1; l<n; ++l){
+		offsets[l] = offsets[l-1] + size_t(lw)*lh*4;
+		downsampleImage(&levels[offsets[l-1]], lw, lh, &levels[offsets[l]]);
+		lw = max(lw/2,1); lh = max(lh/2,1);
+	}
+}
+
+
+// ===========================================================
+// class TexturePage
+// ===========================================================
+
+TexturePage::TexturePage(int w, int h, int layers, GLenum _format){
+	width = w; height = h;
+	format = _format;
+	nLayers = layers;
+	nLevels = mipLevels(w, h);
+	
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+	if (GLEW_ARB_texture_storage) 
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, nLevels, format, width, height, nLayers);
+	else if (isCompressedFormat(format))
+		for (int l=0; l<nLevels; ++l) 
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, l, format, max(width>>l,1), max(height>>l,1), nLayers, 0, levelBytes(format, max(width>>l,1), max(height>>l,1))*nLayers, NULL);
+	else 
+		for (int l=0; l<nLevels; ++l) 
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, l, format, max(width>>l,1), max(height>>l,1), nLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);	// trilinear: the mip level follows the on-screen size
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	
+	for (int i=nLayers-1; i>=0; --i) freeLayers.push_back(i);
+	slots.resize(nLayers, NULL);
+}
+
+TexturePage::~TexturePage(){
+	glDeleteTextures(1, &tex);
+}
+
+size_t TexturePage::bytes(){
+	return layerBytes()*nLayers;
+}
+
+size_t TexturePage::layerBytes(){
+	size_t b = 0;
+	for (int l=0; l<nLevels; ++l) b += levelBytes(format, max(width>>l,1), max(height>>l,1));
+	return b;
+}
+
+
+// ===========================================================
+// class TexturePool
+// ===========================================================
+
+void TexturePool::init(){
+	GLint maxTex, maxLay;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTex);
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLay);
+	
+	minSize = 64;
+	maxSize = min(int(maxTex), 4096);	// larger photos are halved on upload
+	maxLayers = min(int(maxLay), 64);
+	pageBytes = 64*1024*1024;
+}
+
+void TexturePool::destroy(){
+	for (int i=0; i<pages.size(); ++i) delete pages[i];
+	pages.clear();
+	shared.clear();
+}
+
+
+TexturePage * TexturePool::findPage(int w, int h, GLenum format, bool grow){
+	for (int i=0; i<pages.size(); ++i){
+		if (pages[i]->width == w && pages[i]->height == h && pages[i]->format == format && !pages[i]->freeLayers.empty()) return pages[i];
+	}
+	if (!grow) return NULL;
+	
+	TexturePage * p = new TexturePage(w, h, newPageLayers(w, h, format), format);
+	pages.push_back(p);
+	return p;
+}
+
+// the first pages of a size class are small, so that rare classes waste little memory
+int TexturePool::newPageLayers(int w, int h, GLenum format){
+	int n = 0;
+	for (int i=0; i<pages.size(); ++i) if (pages[i]->width == w && pages[i]->height == h && pages[i]->format == format) ++n;
+	int layers = pageBytes/levelBytes(format, w, h);
+	return max(1, min(min(layers, maxLayers), 4 << min(n, 8)));
+}
+
+size_t TexturePool::newPageBytes(int W, int H, GLenum format){
+	size_t b = 0;
+	for (int l=0; l<mipLevels(W, H); ++l) b += levelBytes(format, max(W>>l,1), max(H>>l,1));
+	return b*newPageLayers(W, H, format);
+}
+
+
+void TexturePool::sizeClass(int width, int height, int &w, int &h, int &W, int &H, int limit) const{
+	// images which exceed the largest class are halved until they fit
+	int m = (limit > 0)? min(limit, maxSize) : maxSize;
+	w = width; h = height;
+	while (w > m || h > m){ w = max(w/2,1); h = max(h/2,1); }
+	W = classSize(w);
+	H = classSize(h);
+}
+
+// powers of 2 up to 256, multiples of 256 above: a layer wastes at most half of either
+// dimension for small images and much less for photos, e.g. 3000 x 2000 goes into 3072 x 2048
+int TexturePool::classSize(int n) const{
+	int s = minSize;
+	while (s < n && s < 256) s *= 2;
+	if (s < n) s = (n+255)/256*256;
+	return s;
+}
+
+
+TextureSlot * TexturePool::acquire(unsigned char * pixels, int width, int height){
+	int w, h, W, H;
+	sizeClass(width, height, w, h, W, H);
+	unsigned long long hash = hashImage(pixels, width, height);
+	TextureSlot * slot = findShared(hash, w, h);
+	if (slot != NULL) return slot;
+	
+	slot = allocate(W, H);
+	upload(slot, pixels, width, height);
+	share(slot, hash);
+	return slot;
+}
+
+
+TextureSlot * TexturePool::allocate(int W, int H, GLenum format, bool grow){
+	TexturePage * p = findPage(W, H, format, grow);
+	if (p == NULL) return NULL;
+	TextureSlot * slot = new TextureSlot;
+	slot->page = p;
+	slot->tex = p->tex;
+	slot->layer = p->freeLayers.back();
+	slot->width = slot->height = 0;
+	slot->uvRect = glm::vec4(0.f, 0.f, 0.f, 0.f);
+	slot->refCount = 1;
+	slot->hash = 0;
+	p->freeLayers.pop_back();
+	p->slots[slot->layer] = slot;
+	return slot;
+}
+
+
+void TexturePool::retain(TextureSlot * slot){
+	if (slot != NULL) ++slot->refCount;
+}
+
+
+void TexturePool::release(TextureSlot * slot){
+	if (slot == NULL) return;
+	if (--slot->refCount > 0) return;
+	
+	unshare(slot);
+	TexturePage * p = slot->page;
+	p->freeLayers.push_back(slot->layer);
+	p->slots[slot->layer] = NULL;
+	if (p->freeLayers.size() == p->nLayers){
+		pages.erase(find(pages.begin(), pages.end(), p));
+		delete p;
+	}
+	delete slot;
+}
+
+
+// Frames keep their slot pointer while the image behind it changes (e.g. thumbnail
+// to full resolution): the new layer is swapped in and the old one released with b.
+void TexturePool::swapStorage(TextureSlot * a, TextureSlot * b){
+	swap(a->page, b->page);
+	swap(a->tex, b->tex);
+	swap(a->layer, b->layer);
+	swap(a->width, b->width);
+	swap(a->height, b->height);
+	swap(a->uvRect, b->uvRect);
+	a->page->slots[a->layer] = a;
+	b->page->slots[b->layer] = b;
+	
+	// the registration follows the image
+	swap(a->hash, b->hash);
+	if (a->hash != 0) shared[shareKey(a->hash, a->width, a->height, a->page->format)] = a;
+	if (b->hash != 0) shared[shareKey(b->hash, b->width, b->height, b->page->format)] = b;
+}
+
+
+// Images are shared at the stored size and format: the thumbnail and the full 
+// resolution version of a photo are different slots.
+unsigned long long TexturePool::shareKey(unsigned long long hash, int width, int height, GLenum format){
+	unsigned long long k[4] = {hash, (unsigned long long)width, (unsigned long long)height, (unsigned long long)format};
+	return hashBytes(k, sizeof(k));
+}
+
+// The slot must hold exactly that image: two keys may collide.
+TextureSlot * TexturePool::findShared(unsigned long long hash, int width, int height, GLenum format){
+	if (hash == 0) return NULL;
+	map <unsigned long long, TextureSlot*>::iterator it = shared.find(shareKey(hash, width, height, format));
+	if (it == shared.end()) return NULL;
+	TextureSlot * s = it->second;
+	if (s->hash != hash || s->width != width || s->height != height || s->page->format != format) return NULL;
+	retain(it->second);
+	return it->second;
+}
+
+void TexturePool::share(TextureSlot * slot, unsigned long long hash){
+	unshare(slot);
+	if (hash == 0) return;
+	slot->hash = hash;
+	shared[shareKey(hash, slot->width, slot->height, slot->page->format)] = slot;
+}
+
+void TexturePool::unshare(TextureSlot * slot){
+	if (slot->hash == 0) return;
+	map <unsigned long long, TextureSlot*>::iterator it = shared.find(shareKey(slot->hash, slot->width, slot->height, slot->page->format));
+	if (it != shared.end() && it->second == slot) shared.erase(it);
+	slot->hash = 0;
+}
+
+
+// upload the image and its mip levels into the slot's layer
+void TexturePool::upload(TextureSlot * slot, unsigned char * pixels, int width, int height){
+	TexturePage * p = slot->page;
+	int w = width, h = height;
+	while (w > p->width || h > p->height){ w = max(w/2,1); h = max(h/2,1); }
+	
+	vector <unsigned char> levels;
+	vector <size_t> offsets;
+	buildMipChain(pixels, width, height, w, h, p->width, p->height, levels, offsets);
+	uploadLevels(slot, w, h, &levels[0], offsets);
+}
+
+
+// width, height is the size of the image stored in the corner of level 0.
+// With a pixel unpack buffer bound, data is an offset into that buffer and the copy
+// is done by the driver without stalling the caller.
+void TexturePool::uploadLevels(TextureSlot * slot, int width, int height, const unsigned char * data, const vector <size_t> &offsets){
+	unshare(slot);	// other content from now on
+	TexturePage * p = slot->page;
+	slot->width = width;
+	slot->height = height;
+	slot->uvRect = glm::vec4(0.f, 0.f, float(width)/p->width, float(height)/p->height);
+	
+	glBindTexture(GL_TEXTURE_2D_ARRAY, p->tex);
+	for (int l=0; l<p->nLevels; ++l){
+		int lw = max(p->width>>l,1), lh = max(p->height>>l,1);
+		if (isCompressedFormat(p->format))
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, slot->layer, lw, lh, 1, p->format, levelBytes(p->format, lw, lh), data + offsets[l]);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, l, 0, 0, slot->layer, lw, lh, 1, GL_RGBA, GL_UNSIGNED_BYTE, data + offsets[l]);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+
+size_t TexturePool::gpuBytes(){
+	size_t b = 0;
+	for (int i=0; i<pages.size(); ++i) b += pages[i]->bytes();
+	return b;
+}
+
+
+static bool fewerLayersUsed(const TexturePage * a, const TexturePage * b){
+	return a->nLayers - a->freeLayers.size() < b->nLayers - b->freeLayers.size();
+}
+
+// Within each size class and format, the emptiest page is emptied into the free layers
+// of the fuller ones if they have room for all of its images, and so on.
+size_t TexturePool::compact(){
+	if (!GLEW_ARB_copy_image) return 0;
+	
+	size_t freed = 0;
+	vector <TexturePage*> rest = pages;
+	while (!rest.empty()){
+		// the pages of the class of rest[0]
+		vector <TexturePage*> group, other;
+		for (int i=0; i<rest.size(); ++i){
+			TexturePage * p = rest[i];
+			if (p->width == rest[0]->width && p->height == rest[0]->height && p->format == rest[0]->format) group.push_back(p);
+			else other.push_back(p);
+		}
+		rest.swap(other);
+		if (group.size() < 2) continue;
+		
+		sort(group.begin(), group.end(), fewerLayersUsed);
+		for (int i=0; i<group.size()-1; ++i){
+			TexturePage * p = group[i];
+			int used = p->nLayers - p->freeLayers.size(), room = 0;
+			for (int j=i+1; j<group.size(); ++j) room += group[j]->freeLayers.size();
+			if (used > room) continue;
+			
+			// fill the fullest pages first
+			int j = group.size()-1;
+			for (int l=0; l<p->nLayers; ++l){
+				if (p->slots[l] == NULL) continue;
+				while (group[j]->freeLayers.empty()) --j;
+				move(p->slots[l], group[j]);
+			}
+			freed += p->bytes();
+			pages.erase(find(pages.begin(), pages.end(), p));
+			delete p;
+		}
+	}
+	return freed;
+}
+
+// copy the slot's layer with all its levels into a free layer of q, a page of the same class
+void TexturePool::move(TextureSlot * slot, TexturePage * q){
+	TexturePage * p = slot->page;
+	int layer = q->freeLayers.back();
+	q->freeLayers.pop_back();
+	for (int l=0; l<p->nLevels; ++l){
+		glCopyImageSubData(p->tex, GL_TEXTURE_2D_ARRAY, l, 0, 0, slot->layer, 
+		                   q->tex, GL_TEXTURE_2D_ARRAY, l, 0, 0, layer, max(p->width>>l,1), max(p->height>>l,1), 1);
+	}
+	p->slots[slot->layer] = NULL;
+	p->freeLayers.push_back(slot->layer);
+	q->slots[layer] = slot;
+	slot->page = q;
+	slot->tex = q->tex;
+	slot->layer = layer;
+}
+
+void TexturePool::printStats(){
+	int used = 0, total = 0;
+	for (int i=0; i<pages.size(); ++i){
+		total += pages[i]->nLayers;
+		used  += pages[i]->nLayers - pages[i]->freeLayers.size();
+	}
+	cout << "Texture pool: " << pages.size() << " pages, " << used << "/" << total << " layers used, " 
+	     << gpuBytes()/1024.f/1024.f << " MB\n";
+}
+
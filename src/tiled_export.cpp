@@ -0,0 +1,216 @@
+#include "../headers/graphics.h"
+#include "../headers/tiled_export.h"
+
+#include <algorithm>
+#include <cstring>
+#include <climits>
+using namespace std;
+
+// ===========================================================
+// class TiledImageWriter
+// ===========================================================
+
+TiledImageWriter::TiledImageWriter(){
+	fp = NULL;
+	width = height = channels = 0;
+	dataOffset = 0;
+	b_error = false;
+}
+
+bool TiledImageWriter::open(string _filename, int w, int h){
+	filename = _filename;
+	width = w; height = h;
+	b_error = false;
+	
+	bool ppm = (filename.size() > 4 && filename.substr(filename.size()-4) == ".ppm");
+	channels = ppm? 3 : 4;
+	
+	fp = fopen(filename.c_str(), "wb");
+	if (fp == NULL){
+		cout << "ERROR: Could not open " << filename << " for writing\n";
+		return false;
+	}
+	
+	int r;
+	if (ppm) r = fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	else     r = fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+	dataOffset = ftello(fp);
+	
+	// extend the file to its final size, so that tiles can be written in any order
+	if (r < 0 || dataOffset < 0 || fseeko(fp, dataOffset + (long long)width*height*channels - 1, SEEK_SET) != 0 || fputc(0, fp) == EOF){
+		cout << "ERROR: Could not write " << filename << endl;
+		discard();
+		return false;
+	}
+	return true;
+}
+
+bool TiledImageWriter::writeTile(int x, int y, int w, int h, const unsigned char * rgba, bool bottomUp){
+	if (fp == NULL) b_error = true;
+	vector <unsigned char> row(size_t(w)*channels);
+	for (int j=0; j<h && !b_error; ++j){
+		const unsigned char * src = rgba + 4*size_t(w)*(bottomUp? h-1-j : j);
+		if (channels == 4) memcpy(&row[0], src, 4*w);
+		else for (int i=0; i<w; ++i) memcpy(&row[3*i], &src[4*i], 3);
+		
+		if (fseeko(fp, dataOffset + ((long long)(y+j)*width + x)*channels, SEEK_SET) != 0 
+		 || fwrite(&row[0], 1, row.size(), fp) != row.size()) b_error = true;
+	}
+	return !b_error;
+}
+
+// buffered data is only written out by fclose, which can fail as well
+bool TiledImageWriter::close(){
+	if (fp != NULL && fclose(fp) != 0) b_error = true;
+	fp = NULL;
+	if (b_error) cout << "ERROR: Could not write " << filename << endl;
+	return !b_error;
+}
+
+void TiledImageWriter::discard(){
+	if (fp != NULL) fclose(fp);
+	fp = NULL;
+	remove(filename.c_str());
+}
+
+
+// ===========================================================
+// tiled export
+// ===========================================================
+
+struct PendingTile{
+	int x, y, w, h;		// position in the output image
+	GLuint pbo;
+	GLsync fence;
+};
+
+// wait for the readback of a tile and write it out
+static bool writePendingTile(PendingTile &t, TiledImageWriter &writer){
+	glClientWaitSync(t.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(-1));
+	glDeleteSync(t.fence);
+	t.fence = 0;
+	
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, t.pbo);
+	const unsigned char * p = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	bool ok = (p != NULL) && writer.writeTile(t.x, t.y, t.w, t.h, p, true);	// GL rows are bottom up
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return ok;
+}
+
+
+// Load every file backed frame in the region at the detail the export's pixels need, which 
+// is usually far more than the screen shows. The camera must be set to the whole region.
+static void loadExportDetail(){
+	ImageLoader &loader = glRenderer->imageLoader;
+	loader.finish();	// thumbnails first, the detail they queue follows the current camera
+	vector <Frame*> &frames = glRenderer->residency.frames;
+	for (int i=0; i<frames.size(); ++i){
+		Frame * f = frames[i];
+		if (f->b_loading || f->b_loadFailed || f->screenArea() <= 0) continue;
+		int need = f->requiredLimit();
+		if (need > f->residentLimit) loader.request(f, f->filename, LodStage, need);
+	}
+	loader.finish();
+}
+
+bool exportTiled(string filename, float x0, float y0, float x1, float y1, int width, int height, int tileSize){
+	GLint maxRb, maxVp[2];
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRb);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxVp);
+	tileSize = min(tileSize, min(int(maxRb), min(int(maxVp[0]), int(maxVp[1]))));
+	
+	TiledImageWriter writer;
+	if (!writer.open(filename, width, height)) return false;
+	
+	Framebuffer tileFbo;
+	if (!tileFbo.create(tileSize, tileSize)){
+		writer.discard();
+		return false;
+	}
+	
+	// two pixel buffers: one tile is read back while the next is being rendered
+	PendingTile pending[2];
+	for (int k=0; k<2; ++k){
+		glGenBuffers(1, &pending[k].pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pending[k].pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, 4*size_t(tileSize)*tileSize, NULL, GL_STREAM_READ);
+		pending[k].fence = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	
+	// region in view space, and the depth range of the current (orthographic) projection
+	Camera &cam = glRenderer->camera;
+	glm::mat4 proj0 = cam.projection;
+	glm::vec4 v0 = cam.view*glm::vec4(x0, y0, 0.f, 1.f);
+	glm::vec4 v1 = cam.view*glm::vec4(x1, y1, 0.f, 1.f);
+	float depth = -2.f/proj0[2][2];			// far - near
+	float znear = (-proj0[3][2]*depth - depth)/2;
+	float zfar = znear + depth;
+	
+	GLint viewport0[4];
+	glGetIntegerv(GL_VIEWPORT, viewport0);
+	int camViewport0[4] = {cam.viewport[0], cam.viewport[1], cam.viewport[2], cam.viewport[3]};
+	int winWidth0 = cam.windowWidth, winHeight0 = cam.windowHeight;
+	
+	// no placeholders or thumbnails in the exported page
+	cam.setProjection(glm::ortho(v0.x, v1.x, v0.y, v1.y, znear, zfar));
+	cam.setViewport(0, 0, width, height, width, height);
+	loadExportDetail();
+	VirtualTexture::b_synchronous = true;	// the tiles of very large images as well
+	glRenderer->b_exporting = true;			// no selection box or guides in the page
+	
+	int k = 0;
+	bool ok = true;
+	for (int ty=0; ty<height && ok; ty += tileSize){
+		for (int tx=0; tx<width && ok; tx += tileSize){
+			int tw = min(tileSize, width-tx), th = min(tileSize, height-ty);
+			
+			// tile rows go top down in the image, and y goes up in the view
+			float l = v0.x + (v1.x-v0.x)*tx/width;
+			float r = v0.x + (v1.x-v0.x)*(tx+tw)/width;
+			float t = v1.y - (v1.y-v0.y)*ty/height;
+			float b = v1.y - (v1.y-v0.y)*(ty+th)/height;
+			cam.setProjection(glm::ortho(l, r, b, t, znear, zfar));
+			cam.setViewport(0, 0, tw, th, tw, th);		// frames choose their detail for the tile's pixels
+			
+			tileFbo.bind();
+			glViewport(0, 0, tw, th);
+			renderScene();
+			
+			PendingTile &p = pending[k];
+			if (p.fence != 0) ok = writePendingTile(p, writer);		// this buffer was used two tiles ago
+			
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, p.pbo);
+			glReadPixels(0, 0, tw, th, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			p.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			p.x = tx; p.y = ty; p.w = tw; p.h = th;
+			glRenderer->residency.limitTiles(LLONG_MAX);	// the GL keeps what this tile still draws from
+			
+			k = 1-k;
+		}
+	}
+	for (int i=0; i<2; ++i){
+		PendingTile &p = pending[(k+i)%2];	// oldest first
+		if (p.fence != 0 && !writePendingTile(p, writer)) ok = false;
+	}
+	ok = writer.close() && ok;
+	if (!ok) writer.discard();		// no truncated image is left behind
+	
+	for (int i=0; i<2; ++i) glDeleteBuffers(1, &pending[i].pbo);
+	tileFbo.destroy();
+	
+	// restore the on-screen state
+	VirtualTexture::b_synchronous = false;
+	glRenderer->b_exporting = false;
+	cam.setProjection(proj0);
+	cam.setViewport(camViewport0[0], camViewport0[1], camViewport0[2], camViewport0[3], winWidth0, winHeight0);
+	if (glRenderer->offscreen != NULL) glRenderer->offscreen->bind();
+	else glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(viewport0[0], viewport0[1], viewport0[2], viewport0[3]);
+	glRenderer->markDirty();
+	
+	return ok;
+}
+
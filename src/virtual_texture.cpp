@@ -0,0 +1,436 @@
+#include "../headers/graphics.h"
+#include "../headers/virtual_texture.h"
+#include "../headers/image_io.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+using namespace std;
+
+static const int TILE_STORE_VERSION = 2;
+static const size_t TILE_STORE_HEADER = 4096;	// header block, keeps the tiles page aligned
+
+bool VirtualTexture::b_synchronous = false;
+
+
+// Sizes of the pyramid levels: halved (rounding up) until the level fits maxSize.
+// The last level is the overview.
+static void pyramidLevels(int width, int height, int maxSize, vector <int> &lw, vector <int> &lh){
+	lw.assign(1, width);
+	lh.assign(1, height);
+	while (max(lw.back(), lh.back()) > maxSize){
+		lw.push_back((lw.back()+1)/2);
+		lh.push_back((lh.back()+1)/2);
+	}
+}
+
+static size_t tileCount(const vector <int> &lw, const vector <int> &lh, int tileSize){
+	size_t n = 0;
+	for (int l=0; l+1<lw.size(); ++l) n += size_t((lw[l]+tileSize-1)/tileSize) * ((lh[l]+tileSize-1)/tileSize);
+	return n;
+}
+
+
+// ===========================================================
+// tile store builder
+// ===========================================================
+
+// Streams the image rows through the pyramid: each level collects a band of
+// tileSize rows, writes it out as tiles once full, and passes every pair of
+// rows on to the next level, downsampled. The last level (the overview) is
+// kept in memory.
+class TileStoreBuilder{
+	public:
+	struct Level{
+		int w, h;
+		int y;							// rows received
+		vector <unsigned char> band;	// tileSize rows
+		vector <unsigned char> carry;	// even row waiting for its pair
+		size_t firstTile;
+	};
+	vector <Level> levels;
+	int tileSize;
+	int fd;
+	bool ok;
+	vector <unsigned char> tile;
+	vector <unsigned char> overview;
+
+	public:
+	TileStoreBuilder(const vector <int> &lw, const vector <int> &lh, int _tileSize, int _fd){
+		tileSize = _tileSize;
+		fd = _fd;
+		ok = true;
+		levels.resize(lw.size());
+		size_t first = 0;
+		for (int l=0; l<levels.size(); ++l){
+			Level &L = levels[l];
+			L.w = lw[l];
+			L.h = lh[l];
+			L.y = 0;
+			L.firstTile = first;
+			if (l+1 < levels.size()){
+				L.band.resize(size_t(tileSize)*L.w*4);
+				first += size_t((L.w+tileSize-1)/tileSize) * ((L.h+tileSize-1)/tileSize);
+			}
+		}
+		overview.resize(size_t(lw.back())*lh.back()*4);
+		tile.resize(size_t(tileSize)*tileSize*4);
+	}
+
+	void addRow(int l, const unsigned char * row){
+		Level &L = levels[l];
+		size_t rowBytes = size_t(L.w)*4;
+		if (l+1 == levels.size()){
+			memcpy(&overview[L.y*rowBytes], row, rowBytes);
+			++L.y;
+			return;
+		}
+
+		memcpy(&L.band[(L.y % tileSize)*rowBytes], row, rowBytes);
+		++L.y;
+		if (L.y % tileSize == 0 || L.y == L.h) writeBand(l);
+
+		// pairs of rows (the last one on its own if the height is odd) make a row of the next level
+		if (L.y % 2 == 1 && L.y < L.h){
+			L.carry.assign(row, row+rowBytes);
+			return;
+		}
+		const unsigned char * r0 = (L.y % 2 == 0)? &L.carry[0] : row;
+		int w2 = (L.w+1)/2;
+		vector <unsigned char> d(size_t(w2)*4);
+		for (int i=0; i<w2; ++i){
+			int i0 = 4*(2*i), i1 = 4*min(2*i+1, L.w-1);
+			for (int c=0; c<4; ++c) d[4*i+c] = (r0[i0+c] + r0[i1+c] + row[i0+c] + row[i1+c] + 2)/4;
+		}
+		addRow(l+1, &d[0]);
+	}
+
+	// cut the band of rows ending at row L.y into tiles, edge texels repeated to fill partial tiles
+	void writeBand(int l){
+		Level &L = levels[l];
+		int ty = (L.y-1)/tileSize;
+		int nRows = L.y - ty*tileSize;
+		int nx = (L.w+tileSize-1)/tileSize;
+		size_t tileBytes = tile.size();
+		for (int tx=0; tx<nx; ++tx){
+			int x0 = tx*tileSize, n = min(tileSize, L.w-x0);
+			for (int j=0; j<tileSize; ++j){
+				const unsigned char * src = &L.band[(size_t(min(j, nRows-1))*L.w + x0)*4];
+				unsigned char * dst = &tile[size_t(j)*tileSize*4];
+				memcpy(dst, src, size_t(n)*4);
+				for (int i=n; i<tileSize; ++i) memcpy(dst+4*i, src+4*(n-1), 4);
+			}
+			off_t offset = TILE_STORE_HEADER + (L.firstTile + size_t(ty)*nx + tx)*tileBytes;
+			if (pwrite(fd, &tile[0], tileBytes, offset) != tileBytes) ok = false;
+		}
+	}
+};
+
+
+// ===========================================================
+// class VirtualTexture
+// ===========================================================
+
+VirtualTexture::VirtualTexture(){
+	width = height = 0;
+	tileSize = 256;
+	nLevels = 0;
+	maxUploads = 8;
+	nPending = 0;
+	data = NULL;
+	dataSize = 0;
+}
+
+VirtualTexture::~VirtualTexture(){
+	releaseTiles();
+	if (data != NULL) munmap(data, dataSize);
+}
+
+
+bool VirtualTexture::prepare(const string &filename, const string &store, int tileSize, int maxSize, vector <unsigned char> &overview, int &width, int &height){
+	struct stat src;
+	if (stat(filename.c_str(), &src) != 0) return false;
+
+	// an existing store: read the overview back
+	int fd = ::open(store.c_str(), O_RDONLY);
+	if (fd >= 0){
+		TileStoreHeader h;
+		bool ok = (pread(fd, &h, sizeof(h), 0) == sizeof(h)
+		           && memcmp(h.magic, "VTEX", 4) == 0 && h.version == TILE_STORE_VERSION
+		           && h.srcSize == src.st_size && h.srcMtime == modificationTime(src) && h.tileSize == tileSize);
+		if (ok){
+			vector <int> lw, lh;
+			pyramidLevels(h.width, h.height, maxSize, lw, lh);
+			ok = (lw.size() == h.nLevels+1 && lw.back() == h.overviewWidth && lh.back() == h.overviewHeight);
+			if (ok){
+				width = h.overviewWidth;
+				height = h.overviewHeight;
+				overview.resize(size_t(width)*height*4);
+				off_t offset = TILE_STORE_HEADER + tileCount(lw, lh, tileSize)*size_t(tileSize)*tileSize*4;
+				ok = (pread(fd, &overview[0], overview.size(), offset) == overview.size());
+			}
+		}
+		close(fd);
+		if (ok) return true;
+	}
+
+	// build it, streaming the source
+	ImageReader reader;
+	if (!reader.open(filename)) return false;
+	vector <int> lw, lh;
+	pyramidLevels(reader.width, reader.height, maxSize, lw, lh);
+	size_t tileBytes = size_t(tileSize)*tileSize*4;
+	size_t total = TILE_STORE_HEADER + tileCount(lw, lh, tileSize)*tileBytes + size_t(lw.back())*lh.back()*4;
+
+	stringstream tmp;
+	tmp << store << ".tmp." << getpid() << "." << this_thread::get_id();
+	fd = ::open(tmp.str().c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) return false;
+	bool ok = (ftruncate(fd, total) == 0);
+
+	TileStoreBuilder builder(lw, lh, tileSize, fd);
+	vector <unsigned char> row(size_t(reader.width)*4);
+	for (int j=0; j<reader.height && ok; ++j){
+		ok = reader.readRow(&row[0]);
+		if (ok) builder.addRow(0, &row[0]);
+		ok = ok && builder.ok;
+	}
+
+	TileStoreHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "VTEX", 4);
+	h.version = TILE_STORE_VERSION;
+	h.srcSize = src.st_size;
+	h.srcMtime = modificationTime(src);
+	h.width = reader.width;
+	h.height = reader.height;
+	h.tileSize = tileSize;
+	h.nLevels = lw.size()-1;
+	h.overviewWidth = lw.back();
+	h.overviewHeight = lh.back();
+	h.hasAlpha = imageHasAlpha(&builder.overview[0], lw.back(), lh.back());
+	if (ok) ok = (pwrite(fd, &h, sizeof(h), 0) == sizeof(h));
+	if (ok) ok = (pwrite(fd, &builder.overview[0], builder.overview.size(), total - builder.overview.size()) == builder.overview.size());
+	close(fd);
+
+	if (!ok || rename(tmp.str().c_str(), store.c_str()) != 0){
+		cout << "WARNING: Could not write the tile store of " << filename << "\n";
+		unlink(tmp.str().c_str());
+		return false;
+	}
+
+	overview.swap(builder.overview);
+	width = lw.back();
+	height = lh.back();
+	return true;
+}
+
+
+bool VirtualTexture::open(const string &_store){
+	int fd = ::open(_store.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	store = _store;
+	TileStoreHeader h;
+	struct stat st;
+	bool ok = (fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h)
+	           && memcmp(h.magic, "VTEX", 4) == 0 && h.version == TILE_STORE_VERSION);
+	if (ok){
+		width = h.width;
+		height = h.height;
+		tileSize = h.tileSize;
+		nLevels = h.nLevels;
+
+		// the levels above the overview, as laid out by prepare()
+		levelWidth.assign(1, width);
+		levelHeight.assign(1, height);
+		for (int l=1; l<=nLevels; ++l){
+			levelWidth.push_back((levelWidth.back()+1)/2);
+			levelHeight.push_back((levelHeight.back()+1)/2);
+		}
+		tilesX.resize(nLevels);
+		tilesY.resize(nLevels);
+		firstTile.resize(nLevels);
+		size_t n = 0;
+		for (int l=0; l<nLevels; ++l){
+			tilesX[l] = (levelWidth[l]+tileSize-1)/tileSize;
+			tilesY[l] = (levelHeight[l]+tileSize-1)/tileSize;
+			firstTile[l] = n;
+			n += size_t(tilesX[l])*tilesY[l];
+		}
+		dataSize = TILE_STORE_HEADER + n*tileSize*tileSize*4 + size_t(h.overviewWidth)*h.overviewHeight*4;
+		ok = (st.st_size == dataSize);
+	}
+	if (ok){
+		data = (unsigned char*)mmap(NULL, dataSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED){ data = NULL; ok = false; }
+	}
+	close(fd);
+	return ok;
+}
+
+
+long long VirtualTexture::tileKey(int level, int tx, int ty){
+	return (((long long)level << 24 | ty) << 24) | tx;
+}
+
+const unsigned char * VirtualTexture::tileData(int level, int tx, int ty){
+	size_t tileBytes = size_t(tileSize)*tileSize*4;
+	return data + TILE_STORE_HEADER + (firstTile[level] + size_t(ty)*tilesX[level] + tx)*tileBytes;
+}
+
+TextureSlot * VirtualTexture::uploadTile(int level, int tx, int ty){
+	TexturePool &pool = glRenderer->texturePool;
+	TextureSlot * slot = pool.allocate(tileSize, tileSize);
+
+	vector <unsigned char> levels;
+	vector <size_t> offsets;
+	buildMipChain(tileData(level, tx, ty), tileSize, tileSize, tileSize, tileSize, tileSize, tileSize, levels, offsets);
+	const unsigned char * src = glRenderer->imageLoader.stageUpload(&levels[0], levels.size());
+	pool.uploadLevels(slot, tileSize, tileSize, src, offsets);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return slot;
+}
+
+
+// The pyramid level is the coarsest one with at least one texel per window pixel.
+// Tiles seen for the first time are only prefetched: they are uploaded in a later
+// frame, once the kernel has had the chance to read them, and the overview shows
+// through until then. In synchronous mode they are read and uploaded right away.
+void VirtualTexture::render(Frame * f){
+	long long now = glRenderer->residency.frameNumber;
+	nPending = 0;
+
+	glm::mat4 pv = glRenderer->camera.viewProjection;
+	float z = 0.1f*f->layer;
+	glm::vec4 a = pv*glm::vec4(f->x0, f->y0, z, 1.f);
+	glm::vec4 b = pv*glm::vec4(f->x1, f->y1, z, 1.f);
+	float pw = fabs(b.x/b.w - a.x/a.w)/2*glRenderer->camera.viewport[2];
+	glm::vec4 crop = f->uvRect;
+
+	float texelsPerPixel = crop.z*width/max(pw, 1e-6f);
+	int level = 0;
+	while (level < nLevels && texelsPerPixel >= 2){
+		texelsPerPixel /= 2;
+		++level;
+	}
+	if (level >= nLevels || data == NULL){	// the overview is detailed enough
+		dropUnused(now);
+		return;
+	}
+
+	// part of the frame inside the viewport, as a range of image coordinates
+	glm::mat4 inv = glm::inverse(pv);
+	glm::vec4 p0 = inv*glm::vec4(-1.f, -1.f, a.z/a.w, 1.f);
+	glm::vec4 p1 = inv*glm::vec4( 1.f,  1.f, a.z/a.w, 1.f);
+	float vx0 = max(f->x0, min(p0.x/p0.w, p1.x/p1.w)), vx1 = min(f->x1, max(p0.x/p0.w, p1.x/p1.w));
+	float vy0 = max(f->y0, min(p0.y/p0.w, p1.y/p1.w)), vy1 = min(f->y1, max(p0.y/p0.w, p1.y/p1.w));
+	if (vx0 >= vx1 || vy0 >= vy1){
+		dropUnused(now);
+		return;
+	}
+	float fw = f->x1 - f->x0, fh = f->y1 - f->y0;
+	float u0 = crop.x + (vx0 - f->x0)/fw*crop.z, u1 = crop.x + (vx1 - f->x0)/fw*crop.z;
+	float v0 = crop.y + (f->y1 - vy1)/fh*crop.w, v1 = crop.y + (f->y1 - vy0)/fh*crop.w;	// v = 0 is the top of the image
+
+	int lw = levelWidth[level], lh = levelHeight[level];
+	int tx0 = max(int(u0*lw/tileSize), 0), tx1 = min(int(u1*lw/tileSize), tilesX[level]-1);
+	int ty0 = max(int(v0*lh/tileSize), 0), ty1 = min(int(v1*lh/tileSize), tilesY[level]-1);
+
+	int nUploads = 0;
+	size_t tileBytes = size_t(tileSize)*tileSize*4;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	for (int ty=ty0; ty<=ty1; ++ty){
+		for (int tx=tx0; tx<=tx1; ++tx){
+			long long key = tileKey(level, tx, ty);
+			map <long long, Tile>::iterator it = tiles.find(key);
+			if (it == tiles.end() && b_synchronous){
+				Tile t = {NULL, now};
+				it = tiles.insert(make_pair(key, t)).first;
+			}
+			else if (it == tiles.end()){
+				const unsigned char * p = tileData(level, tx, ty);
+				size_t skew = size_t(p - data) % pageSize;
+				madvise((void*)(p - skew), tileBytes + skew, MADV_WILLNEED);
+				Tile t = {NULL, now};
+				tiles[key] = t;
+				++nPending;
+				continue;
+			}
+			Tile &t = it->second;
+			t.lastUsed = now;
+			if (t.slot == NULL){
+				if (nUploads >= maxUploads && !b_synchronous){
+					++nPending;
+					continue;
+				}
+				t.slot = uploadTile(level, tx, ty);
+				++nUploads;
+			}
+
+			// the part of the tile inside the shown crop
+			float tu0 = max(float(tx*tileSize)/lw, crop.x), tu1 = min(float(min((tx+1)*tileSize, lw))/lw, crop.x+crop.z);
+			float tv0 = max(float(ty*tileSize)/lh, crop.y), tv1 = min(float(min((ty+1)*tileSize, lh))/lh, crop.y+crop.w);
+			if (tu0 >= tu1 || tv0 >= tv1) continue;
+
+			FrameInstance inst;
+			inst.rect = glm::vec4(f->x0 + (tu0-crop.x)/crop.z*fw, f->y1 - (tv1-crop.y)/crop.w*fh,
+			                      f->x0 + (tu1-crop.x)/crop.z*fw, f->y1 - (tv0-crop.y)/crop.w*fh);
+			glm::vec4 s = t.slot->uvRect;
+			float su0 = tu0*lw/tileSize - tx, su1 = tu1*lw/tileSize - tx;
+			float sv0 = tv0*lh/tileSize - ty, sv1 = tv1*lh/tileSize - ty;
+			inst.uvRect = glm::vec4(s.x + su0*s.z, s.y + sv0*s.w, (su1-su0)*s.z, (sv1-sv0)*s.w);
+			inst.zSlice = glm::vec2(z + 0.01f, t.slot->layer);	// just above the overview, below the next layer
+			glRenderer->frameRenderer.submit(inst, t.slot->tex);
+		}
+	}
+
+	if (nPending > 0) glRenderer->markDirty();	// come back for the tiles still missing
+	dropUnused(now);
+}
+
+
+// forget prefetches no longer on screen; resident tiles are limited by the ResidencyManager
+void VirtualTexture::dropUnused(long long frameNumber){
+	for (map <long long, Tile>::iterator it = tiles.begin(); it != tiles.end(); ){
+		if (it->second.slot == NULL && it->second.lastUsed < frameNumber) tiles.erase(it++);
+		else ++it;
+	}
+}
+
+void VirtualTexture::residentTiles(vector <TileUse> &out){
+	for (map <long long, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it){
+		if (it->second.slot == NULL) continue;
+		TileUse u = {it->second.lastUsed, this, it->first};
+		out.push_back(u);
+	}
+}
+
+void VirtualTexture::releaseTile(long long key){
+	map <long long, Tile>::iterator it = tiles.find(key);
+	if (it == tiles.end()) return;
+	if (it->second.slot != NULL) glRenderer->texturePool.release(it->second.slot);
+	tiles.erase(it);
+}
+
+void VirtualTexture::releaseTiles(){
+	for (map <long long, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it){
+		if (it->second.slot != NULL) glRenderer->texturePool.release(it->second.slot);
+	}
+	tiles.clear();
+}
+
+size_t VirtualTexture::residentBytes(){
+	size_t b = 0;
+	for (map <long long, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it){
+		if (it->second.slot != NULL) b += it->second.slot->page->layerBytes();
+	}
+	return b;
+}